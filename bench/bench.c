@@ -0,0 +1,279 @@
+/*
+ * Copyright Joyent, Inc. and other Node contributors.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "shim.h"
+
+/*
+ * Each function here has a twin in raw.cc that does the same work against
+ * the V8 API directly, bench/index.js runs them side by side
+ */
+
+/* Does nothing, measures the cost of crossing the boundary */
+int
+noop(shim_ctx_t* ctx, shim_args_t* args)
+{
+  return TRUE;
+}
+
+
+/* Returns the number of arguments, touches argv so it can't be elided */
+int
+argc(shim_ctx_t* ctx, shim_args_t* args)
+{
+  size_t len = shim_args_length(args);
+
+  if (len > 0 && shim_args_get(args, len - 1) == NULL)
+    return FALSE;
+
+  shim_args_set_rval(ctx, args, shim_integer_uint(ctx, len));
+  return TRUE;
+}
+
+
+/* unpack_typed() is the same as unpack() through shim.hpp, see typed.cc */
+int unpack_typed(shim_ctx_t* ctx, shim_args_t* args);
+
+
+/* unpack(int32, number, string, bool) */
+int
+unpack(shim_ctx_t* ctx, shim_args_t* args)
+{
+  int32_t i;
+  double d;
+  shim_val_t* s = shim_value_new(ctx);
+  shim_bool_t b;
+
+  if (!shim_unpack(ctx, args,
+        SHIM_TYPE_INT32, &i,
+        SHIM_TYPE_NUMBER, &d,
+        SHIM_TYPE_STRING, &s,
+        SHIM_TYPE_BOOL, &b,
+        SHIM_TYPE_UNKNOWN))
+    return FALSE;
+
+  shim_args_set_rval(ctx, args, shim_number_new(ctx, i + d + b));
+  return TRUE;
+}
+
+
+/* props(obj) reads obj.a and stores it in obj.b */
+int
+props(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* obj = shim_args_get(args, 0);
+  shim_val_t* val = shim_value_new(ctx);
+
+  if (!shim_obj_get_prop_name(ctx, obj, "a", val))
+    return FALSE;
+
+  return shim_obj_set_prop_name(ctx, obj, "b", val);
+}
+
+
+/* call(fn, arg) calls fn(arg) */
+int
+call(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* argv[] = { shim_args_get(args, 1) };
+  shim_val_t* ret = shim_value_new(ctx);
+
+  return shim_func_call_val(ctx, NULL, shim_args_get(args, 0), 1, argv, ret);
+}
+
+
+/* callback(fn, arg) calls fn(arg) through MakeCallback */
+int
+callback(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* argv[] = { shim_args_get(args, 1) };
+  shim_val_t* ret = shim_value_new(ctx);
+
+  return shim_make_callback_val(ctx, NULL, shim_args_get(args, 0), 1, argv,
+    ret);
+}
+
+
+static shim_callback_t* held_cb = NULL;
+
+
+/* held(fn, arg) calls fn(arg) through a callback held across calls */
+int
+held(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* argv[] = { shim_args_get(args, 1) };
+
+  if (held_cb == NULL)
+    held_cb = shim_callback_new(ctx, shim_args_get(args, 0), NULL);
+
+  return shim_callback_make(ctx, held_cb, 1, argv, NULL);
+}
+
+
+/* string(str) returns a copy of str made through C */
+int
+string(shim_ctx_t* ctx, shim_args_t* args)
+{
+  const char* str = shim_string_value(shim_args_get(args, 0));
+  shim_args_set_rval(ctx, args, shim_string_new_copy(ctx, str));
+  free((void*)str);
+  return TRUE;
+}
+
+
+/* buffer(buf) returns a copy of buf */
+int
+buffer(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* buf = shim_args_get(args, 0);
+  shim_args_set_rval(ctx, args, shim_buffer_new_copy(ctx,
+    shim_buffer_value(buf), shim_buffer_length(buf)));
+  return TRUE;
+}
+
+
+/* buffer_pooled(buf) returns a copy of buf carved out of a shared slab */
+int
+buffer_pooled(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* buf = shim_args_get(args, 0);
+  shim_args_set_rval(ctx, args, shim_buffer_new_pooled(ctx,
+    shim_buffer_value(buf), shim_buffer_length(buf)));
+  return TRUE;
+}
+
+
+typedef struct work_batch_s {
+  uint32_t remaining;
+  shim_val_t* cb;
+} work_batch_t;
+
+
+void
+work_noop(shim_work_t* work, void* hint)
+{
+}
+
+
+void
+work_after(shim_ctx_t* ctx, shim_work_t* work, int status, void* hint)
+{
+  work_batch_t* batch = (work_batch_t*)hint;
+  shim_val_t* ret = shim_value_new(ctx);
+
+  if (--batch->remaining > 0)
+    return;
+
+  shim_make_callback_val(ctx, NULL, batch->cb, 0, NULL, ret);
+  shim_persistent_dispose(batch->cb);
+  free(batch);
+}
+
+
+/* closure(i) returns a new function whose hint is i, see gc.js */
+int
+closure(shim_ctx_t* ctx, shim_args_t* args)
+{
+  uint32_t i;
+
+  if (!shim_unpack_one(ctx, args, 0, SHIM_TYPE_UINT32, &i))
+    return FALSE;
+
+  shim_args_set_rval(ctx, args,
+    shim_func_new(ctx, noop, 0, 0, NULL, (void*)(uintptr_t)i));
+  return TRUE;
+}
+
+
+/* work(n, cb) queues n empty jobs and calls cb once they have all finished */
+int
+work(shim_ctx_t* ctx, shim_args_t* args)
+{
+  uint32_t n, i;
+  work_batch_t* batch;
+
+  if (!shim_unpack_one(ctx, args, 0, SHIM_TYPE_UINT32, &n))
+    return FALSE;
+
+  batch = (work_batch_t*)malloc(sizeof(work_batch_t));
+  batch->remaining = n;
+  batch->cb = shim_persistent_new(ctx, shim_args_get(args, 1));
+
+  for (i = 0; i < n; i++)
+    shim_queue_work(work_noop, work_after, batch);
+
+  return TRUE;
+}
+
+
+shim_bool_t
+work_resolve(shim_ctx_t* ctx, shim_work_t* work, int status, void* hint,
+  shim_val_t** rval)
+{
+  return status == 0;
+}
+
+
+/* work_promise() queues an empty job and returns a promise of it */
+int
+work_promise(shim_ctx_t* ctx, shim_args_t* args)
+{
+  shim_val_t* promise = shim_queue_work_promise(ctx, work_noop, work_resolve,
+    NULL);
+
+  if (promise == NULL)
+    return FALSE;
+
+  shim_args_set_rval(ctx, args, promise);
+  return TRUE;
+}
+
+
+int
+bench_init(shim_ctx_t* ctx, shim_val_t* exports, shim_val_t* module)
+{
+  shim_fspec_t funcs[] = {
+    SHIM_FS(noop),
+    SHIM_FS(argc),
+    SHIM_FS(unpack),
+    SHIM_FS(unpack_typed),
+    SHIM_FS(props),
+    SHIM_FS(call),
+    SHIM_FS(callback),
+    SHIM_FS(held),
+    SHIM_FS(string),
+    SHIM_FS(buffer),
+    SHIM_FS(buffer_pooled),
+    SHIM_FS(closure),
+    SHIM_FS(work),
+    SHIM_FS(work_promise),
+    SHIM_FS_STATS,
+    SHIM_FS_END,
+  };
+
+  shim_obj_set_funcs(ctx, exports, funcs);
+  return TRUE;
+}
+
+SHIM_MODULE(shim_bench, bench_init)
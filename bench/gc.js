@@ -0,0 +1,42 @@
+/*
+ * Checks that closures made by shim_func_new() are collected, and their
+ * holders freed with them.
+ *
+ *   node-gyp rebuild
+ *   node --expose-gc bench/gc.js
+ *
+ * Before node v0.11.13 V8 keeps every function instantiated from a template
+ * for the lifetime of the context, so there only the count is reported.
+ */
+
+var assert = require('assert');
+var shim = require('../build/Release/shim_bench');
+
+var N = +process.env.N || 100000;
+
+function live() {
+  return shim.shimStats().liveFunctions;
+}
+
+function collectable() {
+  var v = process.versions.node.split('.').map(Number);
+  return v[0] > 0 || v[1] > 11 || (v[1] === 11 && v[2] >= 13);
+}
+
+if (typeof gc !== 'function')
+  throw new Error('run with --expose-gc');
+
+gc();
+var before = live();
+
+for (var i = 0; i < N; i++)
+  shim.closure(i);
+
+gc();
+gc();
+var after = live();
+
+console.log('closures: %d made, %d still live', N, after - before);
+
+if (collectable())
+  assert(after - before < N / 10, 'closures are not being collected');
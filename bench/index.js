@@ -0,0 +1,206 @@
+/*
+ * Boundary crossing benchmarks, each case runs against the addon layer and
+ * against the raw V8 baseline.
+ *
+ *   node-gyp rebuild
+ *   node bench/index.js [filter]
+ *
+ * BATCHES and BATCH control how many timed batches of how many operations
+ * are run, latency percentiles are computed over the per operation time of
+ * each batch. SHIM_STATS=1 also prints the addon layer's own counters at
+ * the end, which costs some time per call.
+ */
+
+var shim = require('../build/Release/shim_bench');
+var raw = require('../build/Release/raw_bench');
+
+var BATCH = +process.env.BATCH || 1000;
+var BATCHES = +process.env.BATCHES || 1000;
+var filter = process.argv[2];
+
+var cases = [];
+
+function sync(name, fn) {
+  cases.push({ name: name, async: false, fn: fn });
+}
+
+function async(name, fn) {
+  cases.push({ name: name, async: true, fn: fn });
+}
+
+function numeric(a, b) {
+  return a - b;
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function ns(diff) {
+  return diff[0] * 1e9 + diff[1];
+}
+
+function report(name, total, lat) {
+  lat.sort(numeric);
+  console.log('%s: %d ops/sec p50 %d ns p99 %d ns', name,
+    Math.round(BATCH * BATCHES / (total / 1e9)),
+    Math.round(percentile(lat, 0.5)),
+    Math.round(percentile(lat, 0.99)));
+}
+
+function runSync(c, done) {
+  var i, b, start, elapsed;
+  var lat = [];
+  var total = 0;
+
+  for (i = 0; i < BATCH * 10; i++)
+    c.fn();
+
+  for (b = 0; b < BATCHES; b++) {
+    start = process.hrtime();
+    for (i = 0; i < BATCH; i++)
+      c.fn();
+    elapsed = ns(process.hrtime(start));
+    total += elapsed;
+    lat.push(elapsed / BATCH);
+  }
+
+  report(c.name, total, lat);
+  done();
+}
+
+function runAsync(c, done) {
+  var lat = [];
+  var total = 0;
+  var b = 0;
+
+  function next() {
+    if (b++ === BATCHES) {
+      report(c.name, total, lat);
+      return done();
+    }
+
+    var start = process.hrtime();
+    c.fn(BATCH, function () {
+      var elapsed = ns(process.hrtime(start));
+      total += elapsed;
+      lat.push(elapsed / BATCH);
+      next();
+    });
+  }
+
+  next();
+}
+
+function run(i) {
+  if (i === cases.length) {
+    if (process.env.SHIM_STATS)
+      console.log(JSON.stringify(shim.shimStats(), null, 2));
+    return;
+  }
+
+  var c = cases[i];
+
+  if (filter && c.name.indexOf(filter) === -1)
+    return run(i + 1);
+
+  (c.async ? runAsync : runSync)(c, function () {
+    run(i + 1);
+  });
+}
+
+[['shim', shim], ['raw', raw]].forEach(function (impl) {
+  var name = impl[0];
+  var mod = impl[1];
+  var obj = { a: 1, b: 0 };
+  var str = new Array(65).join('x');
+  var ascii = new Array(16385).join('x');
+  var utf8 = new Array(4097).join('x\u00e9\u20ac');
+  var buf = new Buffer(64);
+
+  function empty() {}
+
+  sync(name + ' noop', function () {
+    mod.noop();
+  });
+
+  sync(name + ' args(1)', function () {
+    mod.argc(1);
+  });
+
+  sync(name + ' args(4)', function () {
+    mod.argc(1, 2, 3, 4);
+  });
+
+  sync(name + ' args(16)', function () {
+    mod.argc(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+  });
+
+  sync(name + ' unpack', function () {
+    mod.unpack(1, 2.5, 'str', true);
+  });
+
+  if (mod.unpack_typed) {
+    sync(name + ' unpack typed', function () {
+      mod.unpack_typed(1, 2.5, 'str', true);
+    });
+  }
+
+  sync(name + ' props', function () {
+    mod.props(obj);
+  });
+
+  sync(name + ' call', function () {
+    mod.call(empty, 1);
+  });
+
+  sync(name + ' callback', function () {
+    mod.callback(empty, 1);
+  });
+
+  if (mod.held) {
+    sync(name + ' callback held', function () {
+      mod.held(empty, 1);
+    });
+  }
+
+  sync(name + ' string(64)', function () {
+    mod.string(str);
+  });
+
+  sync(name + ' string(16k ascii)', function () {
+    mod.string(ascii);
+  });
+
+  sync(name + ' string(12k utf8)', function () {
+    mod.string(utf8);
+  });
+
+  sync(name + ' buffer(64)', function () {
+    mod.buffer(buf);
+  });
+
+  if (mod.buffer_pooled) {
+    sync(name + ' buffer pooled(64)', function () {
+      mod.buffer_pooled(buf);
+    });
+  }
+
+  async(name + ' queue_work', function (n, cb) {
+    mod.work(n, cb);
+  });
+
+  if (mod.work_promise && typeof Promise === 'function') {
+    async(name + ' queue_work promise', function (n, cb) {
+      var jobs = [];
+      for (var i = 0; i < n; i++)
+        jobs.push(mod.work_promise());
+      Promise.all(jobs).then(function () { cb(); });
+    });
+  }
+});
+
+if (process.env.SHIM_STATS)
+  shim.shimStatsEnable(true);
+
+run(0);
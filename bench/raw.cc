@@ -0,0 +1,225 @@
+/*
+ * Copyright Joyent, Inc. and other Node contributors.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The raw V8 baseline for bench.c, every function does the same work as its
+ * twin without going through the addon layer
+ */
+
+#include "node_version.h"
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+#define V8_USE_UNSAFE_HANDLES 1
+#define V8_ALLOW_ACCESS_TO_RAW_HANDLE_CONSTRUCTOR 1
+#endif
+
+#include "uv.h"
+#include "v8.h"
+#include "node.h"
+#include "node_buffer.h"
+
+namespace raw {
+
+using v8::Function;
+using v8::Handle;
+using v8::HandleScope;
+using v8::Integer;
+using v8::Local;
+using v8::Number;
+using v8::Object;
+using v8::Persistent;
+using v8::String;
+using v8::Undefined;
+using v8::Value;
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+# define RAW_METHOD(name)                                                     \
+  void name(const v8::FunctionCallbackInfo<Value>& args)
+# define RAW_RETURN(val)                                                      \
+  do { args.GetReturnValue().Set(val); return; } while (0)
+# define RAW_RETURN_UNDEFINED() return
+#else
+# define RAW_METHOD(name)                                                     \
+  Handle<Value> name(const v8::Arguments& args)
+# define RAW_RETURN(val) return scope.Close(val)
+# define RAW_RETURN_UNDEFINED() return Undefined()
+#endif
+
+
+RAW_METHOD(Noop)
+{
+  HandleScope scope;
+  RAW_RETURN_UNDEFINED();
+}
+
+
+RAW_METHOD(Argc)
+{
+  HandleScope scope;
+  RAW_RETURN(Integer::NewFromUnsigned(args.Length()));
+}
+
+
+RAW_METHOD(Unpack)
+{
+  HandleScope scope;
+
+  if (!args[0]->IsInt32() || !args[1]->IsNumber() || !args[2]->IsString()
+      || !args[3]->IsBoolean()) {
+    v8::ThrowException(v8::Exception::TypeError(
+      String::New("Arguments not of the right type")));
+    RAW_RETURN_UNDEFINED();
+  }
+
+  int32_t i = args[0]->Int32Value();
+  double d = args[1]->NumberValue();
+  bool b = args[3]->BooleanValue();
+
+  RAW_RETURN(Number::New(i + d + b));
+}
+
+
+RAW_METHOD(Props)
+{
+  HandleScope scope;
+  Local<Object> obj = args[0]->ToObject();
+  obj->Set(String::NewSymbol("b"), obj->Get(String::NewSymbol("a")));
+  RAW_RETURN_UNDEFINED();
+}
+
+
+RAW_METHOD(Call)
+{
+  HandleScope scope;
+  Local<Function> fn = args[0].As<Function>();
+  Handle<Value> argv[] = { args[1] };
+  fn->Call(Object::New(), 1, argv);
+  RAW_RETURN_UNDEFINED();
+}
+
+
+RAW_METHOD(Callback)
+{
+  HandleScope scope;
+  Local<Function> fn = args[0].As<Function>();
+  Handle<Value> argv[] = { args[1] };
+  node::MakeCallback(Object::New(), fn, 1, argv);
+  RAW_RETURN_UNDEFINED();
+}
+
+
+RAW_METHOD(Str)
+{
+  HandleScope scope;
+  String::Utf8Value str(args[0]);
+  RAW_RETURN(String::New(*str, str.length()));
+}
+
+
+RAW_METHOD(Buf)
+{
+  HandleScope scope;
+  Local<Value> buf = args[0];
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  RAW_RETURN(node::Buffer::New(node::Buffer::Data(buf),
+    node::Buffer::Length(buf)));
+#else
+  RAW_RETURN(node::Buffer::New(node::Buffer::Data(buf),
+    node::Buffer::Length(buf))->handle_);
+#endif
+}
+
+
+struct work_batch_s {
+  uint32_t remaining;
+  Persistent<Function> cb;
+};
+
+
+void
+work_noop(uv_work_t* req)
+{
+}
+
+
+void
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+work_after(uv_work_t* req, int status)
+#else
+work_after(uv_work_t* req)
+#endif
+{
+  work_batch_s* batch = static_cast<work_batch_s*>(req->data);
+  delete req;
+
+  if (--batch->remaining > 0)
+    return;
+
+  HandleScope scope;
+  node::MakeCallback(Object::New(), batch->cb, 0, NULL);
+  batch->cb.Dispose();
+  delete batch;
+}
+
+
+RAW_METHOD(Work)
+{
+  HandleScope scope;
+  uint32_t n = args[0]->Uint32Value();
+
+  work_batch_s* batch = new work_batch_s;
+  batch->remaining = n;
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  batch->cb = Persistent<Function>::New(v8::Isolate::GetCurrent(),
+    args[1].As<Function>());
+#else
+  batch->cb = Persistent<Function>::New(args[1].As<Function>());
+#endif
+
+  for (uint32_t i = 0; i < n; i++) {
+    uv_work_t* req = new uv_work_t;
+    req->data = batch;
+    uv_queue_work(uv_default_loop(), req, work_noop, work_after);
+  }
+
+  RAW_RETURN_UNDEFINED();
+}
+
+
+void
+Initialize(Handle<Object> exports)
+{
+  NODE_SET_METHOD(exports, "noop", Noop);
+  NODE_SET_METHOD(exports, "argc", Argc);
+  NODE_SET_METHOD(exports, "unpack", Unpack);
+  NODE_SET_METHOD(exports, "props", Props);
+  NODE_SET_METHOD(exports, "call", Call);
+  NODE_SET_METHOD(exports, "callback", Callback);
+  NODE_SET_METHOD(exports, "string", Str);
+  NODE_SET_METHOD(exports, "buffer", Buf);
+  NODE_SET_METHOD(exports, "work", Work);
+}
+
+}
+
+NODE_MODULE(raw_bench, raw::Initialize)
@@ -9,5 +9,24 @@
         'src/shim.cc',
       ],
     },
+    {
+      'target_name': 'shim_bench',
+      'dependencies': [ 'addon-layer' ],
+      'include_dirs': [ 'include' ],
+      'sources': [
+        'bench/bench.c',
+        'bench/typed.cc',
+      ],
+      'cflags_cc': [ '-std=c++11' ],
+      'xcode_settings': {
+        'OTHER_CPLUSPLUSFLAGS': [ '-std=c++11' ],
+      },
+    },
+    {
+      'target_name': 'raw_bench',
+      'sources': [
+        'bench/raw.cc',
+      ],
+    },
   ],
 }
@@ -56,8 +56,24 @@ typedef enum shim_type {
   SHIM_TYPE_FUNCTION,     /**< v8::Function */
   SHIM_TYPE_STRING,       /**< v8::String */
   SHIM_TYPE_BUFFER,       /**< node::Buffer */
+  SHIM_TYPE_TYPEDARRAY,   /**< Any typed array view, e.g. Float64Array */
+  SHIM_TYPE_ARRAYBUFFER,  /**< ArrayBuffer */
 } shim_type_t;
 
+/** The element types of a typed array */
+typedef enum shim_typedarray_type {
+  SHIM_TYPEDARRAY_UNKNOWN = 0,  /**< Not a typed array */
+  SHIM_TYPEDARRAY_INT8,         /**< Int8Array */
+  SHIM_TYPEDARRAY_UINT8,        /**< Uint8Array */
+  SHIM_TYPEDARRAY_UINT8_CLAMPED,/**< Uint8ClampedArray */
+  SHIM_TYPEDARRAY_INT16,        /**< Int16Array */
+  SHIM_TYPEDARRAY_UINT16,       /**< Uint16Array */
+  SHIM_TYPEDARRAY_INT32,        /**< Int32Array */
+  SHIM_TYPEDARRAY_UINT32,       /**< Uint32Array */
+  SHIM_TYPEDARRAY_FLOAT32,      /**< Float32Array */
+  SHIM_TYPEDARRAY_FLOAT64,      /**< Float64Array */
+} shim_typedarray_type_t;
+
 /**
  * The opaque handle that represents a javascript value
  *
@@ -65,6 +81,49 @@ typedef enum shim_type {
  */
 typedef struct shim_val_s shim_val_t;
 
+/**
+ * The opaque handle that represents an interned property name
+ *
+ * \sa shim_atom_new()
+ */
+typedef struct shim_atom_s shim_atom_t;
+
+/**
+ * The opaque handle that represents a fixed set of properties
+ *
+ * \sa shim_shape_new()
+ */
+typedef struct shim_shape_s shim_shape_t;
+
+/**
+ * The opaque handle that represents a function and receiver held for
+ * repeated calls
+ *
+ * \sa shim_callback_new()
+ */
+typedef struct shim_callback_s shim_callback_t;
+
+/**
+ * The opaque handle that fills chunks and hands them to JavaScript as Buffers
+ *
+ * \sa shim_buffer_writer_new()
+ */
+typedef struct shim_buffer_writer_s shim_buffer_writer_t;
+
+/**
+ * The opaque handle that walks a sequence of Buffers
+ *
+ * \sa shim_buffer_reader_new()
+ */
+typedef struct shim_buffer_reader_s shim_buffer_reader_t;
+
+/**
+ * The opaque handle that represents a nested handle scope
+ *
+ * \sa shim_scope_open()
+ */
+typedef struct shim_scope_s shim_scope_t;
+
 /** The opaque handle that represents the currently executing context */
 typedef struct shim_ctx_s shim_ctx_t;
 
@@ -74,6 +133,9 @@ typedef struct shim_args_s shim_args_t;
 /** A wrapper for TRUE and FALSE that is merely an int */
 typedef int shim_bool_t;
 
+/** The callback that will be called when external memory is to be freed */
+typedef void (* shim_buffer_free)(char*, void*);
+
 /** Entry point from node to register the addon layer */
 typedef void (* node_register_func)(void*, void*);
 /** The declaration of the addon layer entry point */
@@ -144,6 +206,20 @@ typedef struct shim_fspec_s {
 } shim_fspec_t;
 
 
+/**
+ * Describes a property and the struct member it is stored in
+ * \sa shim_obj_get_props()
+ */
+typedef struct shim_field_s {
+  shim_atom_t** atom; /**< Location of the atom naming the property */
+  shim_type_t type;   /**< Type of the member */
+  size_t offset;      /**< Offset of the member in the struct */
+} shim_field_t;
+
+/** Define a field stored in \a member of \a stype named by \a atom */
+#define SHIM_FIELD(atom, type, stype, member)                                 \
+  { &atom, type, (size_t)offset_of(stype, member) }
+
 /** Define the all the properties fo the function */
 #define SHIM_FS_FULL(name, cfunc, nargs, data, flags)                         \
   { name, &cfunc, nargs, data, flags, 0 }
@@ -157,6 +233,14 @@ typedef struct shim_fspec_s {
 #define SHIM_FS_END                                                           \
   { NULL, NULL, 0, NULL, 0, 0 }
 
+/** Release what the shim holds for the current isolate before it goes away */
+void shim_isolate_dispose(shim_ctx_t* ctx);
+
+/* libuv's loop, without making every addon include uv.h */
+struct uv_loop_s;
+/** Set the event loop the current isolate's jobs and channels complete on */
+void shim_isolate_set_loop(shim_ctx_t* ctx, struct uv_loop_s* loop);
+
 /**@}*/
 
 /**
@@ -172,6 +256,8 @@ shim_bool_t shim_value_to(shim_ctx_t* ctx, shim_val_t* val, shim_type_t type,
   shim_val_t* rval);
 
 
+/** Create an empty value to receive the result of another call */
+shim_val_t* shim_value_new(shim_ctx_t* ctx);
 /** Relase memory associated with this value */
 void shim_value_release(shim_val_t* val);
 
@@ -181,6 +267,11 @@ shim_val_t* shim_undefined();
 shim_val_t* shim_null();
 
 const char* shim_type_str(shim_type_t type);
+
+/** Intern a property name for the lifetime of the isolate */
+shim_atom_t* shim_atom_new(shim_ctx_t* ctx, const char* name);
+/** Get the name an atom was created with */
+const char* shim_atom_name(shim_atom_t* atom);
 /**@}*/
 
 
@@ -197,6 +288,12 @@ shim_val_t* shim_obj_new(shim_ctx_t* context, shim_val_t* klass,
 shim_val_t* shim_obj_new_instance(shim_ctx_t* context, shim_val_t* klass,
   size_t argc, shim_val_t** argv);
 
+/** Describe objects that all have the given properties */
+shim_shape_t* shim_shape_new(shim_ctx_t* ctx, const char** names, size_t n);
+/** Create a new object of the given shape */
+shim_val_t* shim_obj_new_from_shape(shim_ctx_t* ctx, shim_shape_t* shape,
+  shim_val_t** values);
+
 /** Create a second wrapper of the given object */
 shim_val_t* shim_obj_clone(shim_ctx_t* ctx, shim_val_t* src);
 
@@ -208,6 +305,9 @@ shim_bool_t shim_obj_has_id(shim_ctx_t* ctx, shim_val_t* obj,
   uint32_t id);
 /** Check the object has the given symbol */
 shim_bool_t shim_obj_has_sym(shim_ctx_t* ctx, shim_val_t* obj, shim_val_t* sym);
+/** Check the object has the given atom */
+shim_bool_t shim_obj_has_atom(shim_ctx_t* ctx, shim_val_t* obj,
+  shim_atom_t* atom);
 
 /** Set the value for the named property */
 shim_bool_t shim_obj_set_prop_name(shim_ctx_t* ctx, shim_val_t* recv,
@@ -218,11 +318,20 @@ shim_bool_t shim_obj_set_prop_id(shim_ctx_t* ctx, shim_val_t* recv,
 /** Set the value for the given symbol */
 shim_bool_t shim_obj_set_prop_sym(shim_ctx_t* ctx, shim_val_t* recv,
   shim_val_t* sym, shim_val_t* val);
+/** Set the value for the given atom */
+shim_bool_t shim_obj_set_prop_atom(shim_ctx_t* ctx, shim_val_t* recv,
+  shim_atom_t* atom, shim_val_t* val);
 /** Add arbitrary data to given object */
 shim_bool_t shim_obj_set_private(shim_ctx_t* ctx, shim_val_t* obj, void* data);
+/** Add arbitrary data to given object and account for its size */
+shim_bool_t shim_obj_set_private_sized(shim_ctx_t* ctx, shim_val_t* obj,
+  void* data, size_t size);
 /** Adds a set of functions to an object */
 shim_bool_t shim_obj_set_funcs(shim_ctx_t* ctx, shim_val_t* recv,
   const shim_fspec_t* funcs);
+/** Adds a set of functions that are each made on first access */
+shim_bool_t shim_obj_set_funcs_lazy(shim_ctx_t* ctx, shim_val_t* recv,
+  const shim_fspec_t* funcs);
 
 /** Get the value for the property name */
 shim_bool_t shim_obj_get_prop_name(shim_ctx_t* ctx, shim_val_t* obj,
@@ -233,9 +342,19 @@ shim_bool_t shim_obj_get_prop_id(shim_ctx_t* ctx, shim_val_t* obj,
 /** Get the value for the given symbol */
 shim_bool_t shim_obj_get_prop_sym(shim_ctx_t* ctx, shim_val_t* obj,
   shim_val_t* sym, shim_val_t* rval);
+/** Get the value for the given atom */
+shim_bool_t shim_obj_get_prop_atom(shim_ctx_t* ctx, shim_val_t* obj,
+  shim_atom_t* atom, shim_val_t* rval);
 /** Get the arbitrary data associated with the object */
 shim_bool_t shim_obj_get_private(shim_ctx_t* ctx, shim_val_t* obj, void** data);
 
+/** Unpack a set of properties into a C struct */
+shim_bool_t shim_obj_get_props(shim_ctx_t* ctx, shim_val_t* obj,
+  const shim_field_t* fields, size_t n, void* out);
+/** Pack a C struct into a set of properties */
+shim_bool_t shim_obj_set_props(shim_ctx_t* ctx, shim_val_t* obj,
+  const shim_field_t* fields, size_t n, const void* in);
+
 /**@}*/
 
 
@@ -249,6 +368,8 @@ shim_bool_t shim_obj_get_private(shim_ctx_t* ctx, shim_val_t* obj, void** data);
 shim_val_t* shim_persistent_new(shim_ctx_t* ctx, shim_val_t* val);
 /** Dispose a perisstent value */
 void shim_persistent_dispose(shim_val_t* val);
+/** Get a local handle to the value of a persistent */
+shim_val_t* shim_persistent_local(shim_ctx_t* ctx, shim_val_t* val);
 
 
 /** Callback fired when a peristent is about to be collected  */
@@ -259,6 +380,61 @@ void shim_obj_make_weak(shim_ctx_t* ctx, shim_val_t* val, void* data,
 /** Make a persistent object strong */
 void shim_obj_clear_weak(shim_val_t* val);
 
+
+/**
+ * \typedef shim_handle_table_t
+ * \brief Opaque pointer to a slab allocated table of persistents
+ */
+typedef struct shim_handle_table_s shim_handle_table_t;
+
+/**
+ * Identifies a persistent in a ::shim_handle_table_t, 0 is never valid. The
+ * slot is in the low 32 bits and its generation in the high 32, so an id
+ * that outlived its handle never reaches whatever took the slot next.
+ */
+typedef uint64_t shim_handle_t;
+
+/** Create an empty handle table */
+shim_handle_table_t* shim_handle_table_new();
+/** Make a value persistent in the table */
+shim_handle_t shim_handle_table_add(shim_ctx_t* ctx,
+  shim_handle_table_t* table, shim_val_t* val);
+/** Get the value held by a handle */
+shim_val_t* shim_handle_table_get(shim_ctx_t* ctx,
+  shim_handle_table_t* table, shim_handle_t id);
+/** Dispose a single handle */
+void shim_handle_table_remove(shim_handle_table_t* table, shim_handle_t id);
+/** Make a handle weak, it is removed after weak_cb runs */
+void shim_handle_table_make_weak(shim_handle_table_t* table, shim_handle_t id,
+  void* data, shim_weak_cb weak_cb);
+/** Make a handle strong again */
+void shim_handle_table_clear_weak(shim_handle_table_t* table,
+  shim_handle_t id);
+/** Get the number of live handles and the bytes the table uses */
+void shim_handle_table_stats(shim_handle_table_t* table, size_t* live,
+  size_t* bytes);
+/** Dispose every handle in the table at once */
+void shim_persistent_dispose_all(shim_handle_table_t* table);
+/** Dispose every handle and free the table */
+void shim_handle_table_free(shim_handle_table_t* table);
+
+/**@}*/
+
+
+/**
+ * \defgroup scopes Scope methods
+ * Methods for bounding the handles made by a stretch of code
+ * @{
+ */
+
+/** Open a nested scope */
+shim_scope_t* shim_scope_open(shim_ctx_t* ctx);
+/** Close a scope, releasing every value made in it */
+void shim_scope_close(shim_ctx_t* ctx, shim_scope_t* scope);
+/** Close a scope, keeping one value for the enclosing scope */
+shim_val_t* shim_scope_close_escape(shim_ctx_t* ctx, shim_scope_t* scope,
+  shim_val_t* val);
+
 /**@}*/
 
 
@@ -272,6 +448,13 @@ void shim_obj_clear_weak(shim_val_t* val);
 shim_val_t* shim_func_new(shim_ctx_t* ctx, shim_func cfunc, size_t argc,
   int32_t flags, const char* name, void* data);
 
+/** Callback fired when an instance of a class is collected */
+typedef void (* shim_finalize_cb)(void* data, void* hint);
+/** Create a constructor whose instances hold their private data inline */
+shim_val_t* shim_class_new(shim_ctx_t* ctx, const char* name, shim_func ctor,
+  size_t argc, const shim_fspec_t* methods, shim_finalize_cb finalize_cb,
+  void* hint);
+
 
 /** Get the symbol from the object as a function and call it */
 shim_bool_t shim_func_call_sym(shim_ctx_t* ctx, shim_val_t* self,
@@ -279,6 +462,9 @@ shim_bool_t shim_func_call_sym(shim_ctx_t* ctx, shim_val_t* self,
 /** Get the function by name from an object and call it */
 shim_bool_t shim_func_call_name(shim_ctx_t* ctx, shim_val_t* self,
   const char* name, size_t argc, shim_val_t** argv, shim_val_t* rval);
+/** Get the function by atom from an object and call it */
+shim_bool_t shim_func_call_atom(shim_ctx_t* ctx, shim_val_t* self,
+  shim_atom_t* atom, size_t argc, shim_val_t** argv, shim_val_t* rval);
 /** Call the given function */
 shim_bool_t shim_func_call_val(shim_ctx_t* ctx, shim_val_t* self,
   shim_val_t* func, size_t argc, shim_val_t** argv, shim_val_t* rval);
@@ -293,6 +479,21 @@ shim_bool_t shim_make_callback_val(shim_ctx_t* ctx, shim_val_t* self,
 /** Process the callback for the given name */
 shim_bool_t shim_make_callback_name(shim_ctx_t* ctx, shim_val_t* obj,
   const char* name, size_t argc, shim_val_t** argv, shim_val_t* rval);
+/** Process the callback for the given atom */
+shim_bool_t shim_make_callback_atom(shim_ctx_t* ctx, shim_val_t* obj,
+  shim_atom_t* atom, size_t argc, shim_val_t** argv, shim_val_t* rval);
+
+/** Hold a function and its receiver for repeated calls */
+shim_callback_t* shim_callback_new(shim_ctx_t* ctx, shim_val_t* func,
+  shim_val_t* self);
+/** Call a held function */
+shim_bool_t shim_callback_call(shim_ctx_t* ctx, shim_callback_t* cb,
+  size_t argc, shim_val_t** argv, shim_val_t* rval);
+/** Process the callback for a held function */
+shim_bool_t shim_callback_make(shim_ctx_t* ctx, shim_callback_t* cb,
+  size_t argc, shim_val_t** argv, shim_val_t* rval);
+/** Release a held function */
+void shim_callback_dispose(shim_callback_t* cb);
 
 /**@}*/
 
@@ -339,12 +540,31 @@ size_t shim_string_length(shim_val_t* val);
 /** Get the UTF-8 encoded length of the string */
 size_t shim_string_length_utf8(shim_val_t* val);
 
+/** Options for writing a string to a buffer */
+typedef enum shim_string_flags {
+  SHIM_STRING_NO_OPTIONS = 0,           /**< Default behavior */
+  SHIM_STRING_HINT_MANY_WRITES = 1,     /**< String will be written again */
+  SHIM_STRING_NO_NULL_TERMINATION = 2,  /**< Don't write a trailing NUL */
+} shim_string_flags_t;
+
 /** Get the value of the string */
 const char* shim_string_value(shim_val_t* val);
-/* TODO enum for options */
 /** Write the value of the string to a buffer */
 size_t shim_string_write_ascii(shim_val_t* val, char* buff, size_t start,
   size_t len, int32_t options);
+/** Write the UTF-8 encoded value of the string to a buffer */
+size_t shim_string_write_utf8(shim_val_t* val, char* buff, size_t cap,
+  size_t* nchars, int32_t options);
+/** Borrow the memory of a one byte external string without copying */
+shim_bool_t shim_string_borrow(shim_val_t* val, const char** data,
+  size_t* len);
+
+/** Create a new string that uses the given memory in place */
+shim_val_t* shim_string_new_external(shim_ctx_t* ctx, char* data, size_t len,
+  shim_buffer_free cb, void* hint);
+
+/** Check that the bytes are well formed UTF-8 */
+shim_bool_t shim_utf8_valid(const char* data, size_t len);
 
 /**@}*/
 
@@ -364,6 +584,12 @@ shim_bool_t shim_array_get(shim_ctx_t* ctx, shim_val_t* arr, int32_t idx,
 /** Set the value at the given index */
 shim_bool_t shim_array_set(shim_ctx_t* ctx, shim_val_t* arr, int32_t idx,
   shim_val_t* val);
+/** Convert a run of elements into a C array */
+shim_bool_t shim_array_get_range(shim_ctx_t* ctx, shim_val_t* arr,
+  uint32_t start, size_t n, shim_type_t type, void* out);
+/** Convert a C array into a run of elements */
+shim_bool_t shim_array_set_range(shim_ctx_t* ctx, shim_val_t* arr,
+  uint32_t start, size_t n, shim_type_t type, const void* in);
 
 /**@}*/
 
@@ -373,8 +599,6 @@ shim_bool_t shim_array_set(shim_ctx_t* ctx, shim_val_t* arr, int32_t idx,
  * @{
  */
 
-/** The callback that will be called when the Buffer is to be freed */
-typedef void (* shim_buffer_free)(char*, void*);
 /** Create a new buffer of length */
 shim_val_t* shim_buffer_new(shim_ctx_t*, size_t);
 /** Copy into a new buffer */
@@ -383,11 +607,81 @@ shim_val_t* shim_buffer_new_copy(shim_ctx_t*, const char*, size_t);
 shim_val_t* shim_buffer_new_external(shim_ctx_t*, char*, size_t,
   shim_buffer_free, void*);
 
+/** Create a small buffer carved out of a shared slab */
+shim_val_t* shim_buffer_new_pooled(shim_ctx_t* ctx, const char* data,
+  size_t len);
+/** Choose whether every small buffer is carved out of a shared slab */
+void shim_buffer_pool_enable(shim_bool_t enable);
+
 /** Get the underlying memory for the Buffer */
 char* shim_buffer_value(shim_val_t*);
 /** Get the size of the buffer */
 size_t shim_buffer_length(shim_val_t*);
 
+/** Create a writer that fills chunks and hands them over as Buffers */
+shim_buffer_writer_t* shim_buffer_writer_new(shim_ctx_t* ctx,
+  size_t chunk_size);
+/** Append bytes to the writer */
+shim_bool_t shim_buffer_writer_write(shim_ctx_t* ctx,
+  shim_buffer_writer_t* writer, const char* data, size_t len);
+/** Get contiguous memory to write into directly */
+char* shim_buffer_writer_reserve(shim_ctx_t* ctx, shim_buffer_writer_t* writer,
+  size_t len);
+/** Say how much of the reserved memory was written */
+void shim_buffer_writer_commit(shim_ctx_t* ctx, shim_buffer_writer_t* writer,
+  size_t len);
+/** Take the filled chunks as an array of Buffers */
+shim_val_t* shim_buffer_writer_chunks(shim_ctx_t* ctx,
+  shim_buffer_writer_t* writer);
+/** Get the number of bytes written */
+size_t shim_buffer_writer_length(shim_buffer_writer_t* writer);
+/** Free the writer */
+void shim_buffer_writer_free(shim_buffer_writer_t* writer);
+
+/** Create a reader over a Buffer or an array of Buffers */
+shim_buffer_reader_t* shim_buffer_reader_new(shim_ctx_t* ctx,
+  shim_val_t* chunks);
+/** Get the rest of the current chunk without copying */
+shim_bool_t shim_buffer_reader_next(shim_ctx_t* ctx,
+  shim_buffer_reader_t* reader, char** data, size_t* len);
+/** Look at the rest of the current chunk without consuming it */
+char* shim_buffer_reader_peek(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  size_t* len);
+/** Copy bytes out, across chunks if needed */
+size_t shim_buffer_reader_read(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  char* out, size_t len);
+/** Consume bytes without copying them */
+size_t shim_buffer_reader_skip(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  size_t len);
+/** Get the number of bytes not yet read */
+size_t shim_buffer_reader_remaining(shim_buffer_reader_t* reader);
+/** Free the reader */
+void shim_buffer_reader_free(shim_buffer_reader_t* reader);
+
+/**@}*/
+
+/**
+ * \defgroup typedarrays Typed array methods
+ * Methods for typed arrays and ArrayBuffers
+ * @{
+ */
+
+/** Create a typed array over external memory */
+shim_val_t* shim_typedarray_new_external(shim_ctx_t* ctx,
+  shim_typedarray_type_t type, void* data, size_t len, shim_buffer_free cb,
+  void* hint);
+/** Create an ArrayBuffer over external memory */
+shim_val_t* shim_arraybuffer_new_external(shim_ctx_t* ctx, void* data,
+  size_t len, shim_buffer_free cb, void* hint);
+
+/** Get the element memory, type and length of a typed array */
+void* shim_typedarray_data(shim_val_t* val, shim_typedarray_type_t* type,
+  size_t* len);
+/** Get the memory and byte length of an ArrayBuffer */
+void* shim_arraybuffer_data(shim_val_t* val, size_t* len);
+/** Get the size in bytes of an element of the given type */
+size_t shim_typedarray_element_size(shim_typedarray_type_t type);
+
 /**@}*/
 
 /**
@@ -400,6 +694,8 @@ size_t shim_buffer_length(shim_val_t*);
 shim_val_t* shim_external_new(shim_ctx_t* ctx, void* data);
 /** Get the underlying memory for the external */
 void* shim_external_value(shim_ctx_t* ctx, shim_val_t* val);
+/** Tell the VM how much native memory is kept alive by JS objects */
+int64_t shim_adjust_external_memory(shim_ctx_t* ctx, int64_t delta);
 
 /**@}*/
 
@@ -432,6 +728,43 @@ void shim_throw_type_error(shim_ctx_t* ctx, const char* msg, ...);
 /** Throw a RangeError */
 void shim_throw_range_error(shim_ctx_t* ctx, const char* msg, ...);
 
+/** The constructor an error descriptor throws with */
+typedef enum shim_error_kind {
+  SHIM_ERR_ERROR,
+  SHIM_ERR_TYPE,
+  SHIM_ERR_RANGE,
+} shim_error_kind_t;
+
+/** Options for error descriptors */
+typedef enum shim_error_flags {
+  SHIM_ERROR_DEFAULT = 0,
+  /** Throw one shared error object that has no stack trace */
+  SHIM_ERROR_NOSTACK = 1,
+} shim_error_flags_t;
+
+/**
+ * An expected error declared once, usually as a static. Its message and code
+ * are interned in each isolate on the first throw, after that throwing formats
+ * nothing.
+ *
+ * \sa SHIM_ERROR_DESC() shim_throw_desc()
+ */
+typedef struct shim_error_desc_s {
+  shim_error_kind_t kind;
+  const char* code;     /**< Set as the `code` property, may be NULL */
+  const char* message;
+  int flags;
+} shim_error_desc_t;
+
+/** Initializer for a static shim_error_desc_t */
+#define SHIM_ERROR_DESC(kind, code, message, flags)                           \
+  { kind, code, message, flags }
+
+/** Create the error a descriptor describes */
+shim_val_t* shim_error_desc_new(shim_ctx_t* ctx, const shim_error_desc_t* desc);
+/** Throw the error a descriptor describes */
+void shim_throw_desc(shim_ctx_t* ctx, const shim_error_desc_t* desc);
+
 /**@}*/
 
 /**
@@ -452,6 +785,19 @@ shim_bool_t shim_unpack(shim_ctx_t* ctx, shim_args_t* args, shim_type_t type,
 /** Unpack the arguments by format */
 int shim_unpack_fmt(shim_ctx_t* ctx, shim_args_t* args, const char* fmt, ...);
 
+/** Convert to an int32_t if the value is one, these back shim.hpp */
+shim_bool_t shim_unpack_int32(shim_val_t* val, int32_t* out);
+/** Convert to a uint32_t if the value is one */
+shim_bool_t shim_unpack_uint32(shim_val_t* val, uint32_t* out);
+/** Convert to an int64_t if the value is a number */
+shim_bool_t shim_unpack_int64(shim_val_t* val, int64_t* out);
+/** Convert to a double if the value is a number */
+shim_bool_t shim_unpack_double(shim_val_t* val, double* out);
+/** Convert to a boolean if the value is one */
+shim_bool_t shim_unpack_bool(shim_val_t* val, shim_bool_t* out);
+/** Borrow the memory of a Buffer */
+shim_bool_t shim_unpack_buffer(shim_val_t* val, char** data, size_t* len);
+
 /** How many arguments were passed to this function */
 size_t shim_args_length(shim_args_t* args);
 /** Get the argument at the given index */
@@ -482,8 +828,117 @@ typedef struct shim_work_s shim_work_t;
 typedef void (* shim_work_cb)(shim_work_t*, void*);
 /** Callback on main thread to return to JS */
 typedef void (* shim_after_work)(shim_ctx_t*, shim_work_t*, int, void*);
+/** The status passed to a ::shim_after_work for a cancelled job */
+#define SHIM_WORK_CANCELED (-125)
+
 /** Queue work to be done on background thread */
-void shim_queue_work(shim_work_cb, shim_after_work, void* hint);
+shim_work_t* shim_queue_work(shim_work_cb, shim_after_work, void* hint);
+/**
+ * Callback on main thread that settles the promise of a job, TRUE resolves
+ * it with the value stored in the last argument, undefined if left NULL.
+ * FALSE, or a pending exception, rejects it.
+ */
+typedef shim_bool_t (* shim_resolve_cb)(shim_ctx_t*, shim_work_t*, int, void*,
+  shim_val_t**);
+/** Queue work to be done on background thread and get a promise of it */
+shim_val_t* shim_queue_work_promise(shim_ctx_t* ctx, shim_work_cb work_cb,
+  shim_resolve_cb resolve_cb, void* hint);
+/** Queue a set of jobs that share one callback on the main thread */
+shim_work_t* shim_queue_work_batch(shim_work_cb* work_cbs, size_t n,
+  shim_after_work after_cb, void* hint);
+/** Get the position of a job in its batch */
+size_t shim_work_index(shim_work_t* work);
+/** Cancel a job, or ask it to stop if it has already started */
+void shim_work_cancel(shim_work_t* work);
+/** Whether the given job has been cancelled */
+shim_bool_t shim_work_cancelled(shim_work_t* work);
+/** Report how far along a job is, from its work callback */
+void shim_work_progress_set(shim_work_t* work, size_t progress);
+/** Get the progress last reported by a job */
+size_t shim_work_progress(shim_work_t* work);
+/** Limit the jobs the current isolate hands to the threadpool at once */
+void shim_queue_work_set_limit(size_t limit);
+/** Get the number of the current isolate's jobs waiting for the limit */
+size_t shim_queue_work_pending();
+
+/**
+ * \typedef shim_pool_t
+ * \brief Opaque pointer to a thread pool owned by the addon layer
+ */
+typedef struct shim_pool_s shim_pool_t;
+
+/** Priority classes for jobs queued on a ::shim_pool_t */
+typedef enum shim_priority {
+  SHIM_PRIORITY_HIGH = 0, /**< Picked up before any queued normal job */
+  SHIM_PRIORITY_NORMAL,   /**< The default */
+} shim_priority_t;
+
+/** Create a thread pool separate from the libuv threadpool */
+shim_pool_t* shim_pool_new(size_t nthreads);
+/** Queue work to be done on the given pool */
+shim_work_t* shim_pool_queue_work(shim_pool_t* pool, shim_work_cb work_cb,
+  shim_after_work after_cb, void* hint, shim_priority_t priority);
+/** Finish outstanding work, stop the pool's threads and free it */
+void shim_pool_destroy(shim_pool_t* pool);
+
+/**
+ * \typedef shim_async_t
+ * \brief Opaque pointer to a channel any thread can send messages into
+ */
+typedef struct shim_async_s shim_async_t;
+
+/**
+ * Embedded in whatever is sent through a ::shim_async_t, so sending needs no
+ * allocation. The message belongs to the channel from shim_async_send()
+ * until it is handed to the channel's ::shim_async_convert.
+ */
+typedef struct shim_async_msg_s {
+  struct shim_async_msg_s* next; /**< Private to the channel */
+} shim_async_msg_t;
+
+/** Convert a message into a value on the main thread, NULL for undefined */
+typedef shim_val_t* (*shim_async_convert)(shim_ctx_t* ctx,
+  shim_async_msg_t* msg, void* hint);
+
+/** Create a channel that delivers messages to the given function */
+shim_async_t* shim_async_new(shim_ctx_t* ctx, shim_val_t* func,
+  shim_async_convert convert_cb, void* hint);
+/** Send a message from any thread */
+shim_bool_t shim_async_send(shim_async_t* handle, shim_async_msg_t* msg);
+/** Deliver what is still queued and close the channel */
+void shim_async_close(shim_async_t* handle);
+
+/**@}*/
+
+/**
+ * \defgroup stats Instrumentation methods
+ * Counters and tracing for calls across the boundary
+ * @{
+ */
+
+/** What to record, flags may be combined */
+typedef enum shim_stats_flags {
+  SHIM_STATS_OFF = 0,   /**< Record nothing, the default */
+  SHIM_STATS_COUNT = 1, /**< Count calls, time, wrappers and exceptions */
+  SHIM_STATS_TRACE = 2, /**< Print each call to stderr */
+} shim_stats_flags_t;
+
+/** Choose what is recorded from now on */
+void shim_stats_enable(int flags);
+/** Zero every counter */
+void shim_stats_reset();
+/** Get the counters as an object */
+shim_val_t* shim_stats_snapshot(shim_ctx_t* ctx);
+
+/** JS binding that returns shim_stats_snapshot() */
+int shim_stats_snapshot_js(shim_ctx_t* ctx, shim_args_t* args);
+/** JS binding that calls shim_stats_enable() with its argument */
+int shim_stats_enable_js(shim_ctx_t* ctx, shim_args_t* args);
+
+/** Expose the instrumentation to JS as shimStats and shimStatsEnable */
+#define SHIM_FS_STATS                                                         \
+  SHIM_FS_FULL("shimStats", shim_stats_snapshot_js, 0, NULL, 0),              \
+  SHIM_FS_FULL("shimStatsEnable", shim_stats_enable_js, 1, NULL, 0)
 
 /**@}*/
 
@@ -0,0 +1,243 @@
+/*
+ * Copyright Joyent, Inc. and other Node contributors.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef NODE_SHIM_HPP
+#define NODE_SHIM_HPP
+
+/*
+ * Typed trampolines for C++11 addons. Given a native function such as
+ *
+ *   int32_t add(shim_ctx_t* ctx, int32_t a, double b, shim_buffer_view buf);
+ *
+ * SHIM_TYPED(add) is a ::shim_func that checks the argument count, converts
+ * each argument with the converter for its declared type and wraps the
+ * result, all chosen at compile time. There is no va_list, no format string
+ * and no switch on shim_type_t, errors are only formatted once conversion
+ * has already failed.
+ *
+ * Supported argument types are int32_t, uint32_t, int64_t, double, bool,
+ * shim_buffer_view, shim_string_arg and shim_val_t* (passed through
+ * untouched). The result may be void, int32_t, uint32_t, double or
+ * shim_val_t*.
+ */
+
+#include <cstddef>
+#include <tuple>
+
+#include "shim.h"
+
+/** The memory of a Buffer argument, borrowed for the duration of the call */
+struct shim_buffer_view {
+  char* data;
+  size_t len;
+};
+
+/** A String argument, checked but left unconverted */
+struct shim_string_arg {
+  shim_val_t* val;
+};
+
+namespace shim_typed {
+
+template <typename T> struct arg;
+
+template <> struct arg<int32_t> {
+  int32_t value;
+  static const char* name() { return "an int32"; }
+  bool get(shim_val_t* val) { return shim_unpack_int32(val, &value); }
+};
+
+template <> struct arg<uint32_t> {
+  uint32_t value;
+  static const char* name() { return "a uint32"; }
+  bool get(shim_val_t* val) { return shim_unpack_uint32(val, &value); }
+};
+
+template <> struct arg<int64_t> {
+  int64_t value;
+  static const char* name() { return "a number"; }
+  bool get(shim_val_t* val) { return shim_unpack_int64(val, &value); }
+};
+
+template <> struct arg<double> {
+  double value;
+  static const char* name() { return "a number"; }
+  bool get(shim_val_t* val) { return shim_unpack_double(val, &value); }
+};
+
+template <> struct arg<bool> {
+  bool value;
+  static const char* name() { return "a boolean"; }
+  bool get(shim_val_t* val) {
+    shim_bool_t b;
+    if (!shim_unpack_bool(val, &b))
+      return false;
+    value = b != 0;
+    return true;
+  }
+};
+
+template <> struct arg<shim_buffer_view> {
+  shim_buffer_view value;
+  static const char* name() { return "a Buffer"; }
+  bool get(shim_val_t* val) {
+    return shim_unpack_buffer(val, &value.data, &value.len);
+  }
+};
+
+template <> struct arg<shim_string_arg> {
+  shim_string_arg value;
+  static const char* name() { return "a string"; }
+  bool get(shim_val_t* val) {
+    value.val = val;
+    return shim_value_is(val, SHIM_TYPE_STRING) != 0;
+  }
+};
+
+template <> struct arg<shim_val_t*> {
+  shim_val_t* value;
+  static const char* name() { return "a value"; }
+  bool get(shim_val_t* val) { value = val; return true; }
+};
+
+
+template <typename R> struct result;
+
+template <> struct result<int32_t> {
+  static shim_val_t* wrap(shim_ctx_t* ctx, int32_t r) {
+    return shim_integer_new(ctx, r);
+  }
+};
+
+template <> struct result<uint32_t> {
+  static shim_val_t* wrap(shim_ctx_t* ctx, uint32_t r) {
+    return shim_integer_uint(ctx, r);
+  }
+};
+
+template <> struct result<double> {
+  static shim_val_t* wrap(shim_ctx_t* ctx, double r) {
+    return shim_number_new(ctx, r);
+  }
+};
+
+template <> struct result<shim_val_t*> {
+  static shim_val_t* wrap(shim_ctx_t* ctx, shim_val_t* r) { return r; }
+};
+
+
+template <size_t... I> struct indices {};
+
+template <size_t N, size_t... I>
+struct make_indices : make_indices<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct make_indices<0, I...> {
+  typedef indices<I...> type;
+};
+
+
+template <typename T>
+bool
+convert(shim_ctx_t* ctx, shim_args_t* args, size_t i, arg<T>& out)
+{
+  if (out.get(shim_args_get(args, i)))
+    return true;
+  shim_throw_type_error(ctx, "Argument %u must be %s",
+    static_cast<unsigned>(i), arg<T>::name());
+  return false;
+}
+
+
+/* calls f and wraps what it returns, void results leave the rval alone */
+template <typename R>
+struct call {
+  template <typename F, typename... A>
+  static int
+  run(shim_ctx_t* ctx, shim_args_t* args, F f, A... a)
+  {
+    shim_val_t* rval = result<R>::wrap(ctx, f(ctx, a...));
+    if (rval != NULL)
+      shim_args_set_rval(ctx, args, rval);
+    return TRUE;
+  }
+};
+
+template <>
+struct call<void> {
+  template <typename F, typename... A>
+  static int
+  run(shim_ctx_t* ctx, shim_args_t* args, F f, A... a)
+  {
+    f(ctx, a...);
+    return TRUE;
+  }
+};
+
+
+template <typename F, F f> struct trampoline;
+
+template <typename R, typename... A, R (*f)(shim_ctx_t*, A...)>
+struct trampoline<R (*)(shim_ctx_t*, A...), f> {
+  static int
+  invoke(shim_ctx_t* ctx, shim_args_t* args)
+  {
+    return unpack(ctx, args, typename make_indices<sizeof...(A)>::type());
+  }
+
+  template <size_t... I>
+  static int
+  unpack(shim_ctx_t* ctx, shim_args_t* args, indices<I...>)
+  {
+    if (shim_args_length(args) < sizeof...(A)) {
+      shim_throw_type_error(ctx, "Expected %u arguments",
+        static_cast<unsigned>(sizeof...(A)));
+      return FALSE;
+    }
+
+    std::tuple<arg<A>...> held;
+    bool ok = true;
+
+    /* converts left to right and stops at the first failure */
+    int order[] = { 0, (ok = ok && convert(ctx, args, I,
+      std::get<I>(held)))... };
+    (void) order;
+
+    if (!ok)
+      return FALSE;
+
+    return call<R>::run(ctx, args, f, std::get<I>(held).value...);
+  }
+};
+
+}  /* namespace shim_typed */
+
+/** A ::shim_func for the typed native function f */
+#define SHIM_TYPED(f)                                                         \
+  (&shim_typed::trampoline<decltype(&f), &f>::invoke)
+
+/** Define a function spec for a typed native function */
+#define SHIM_FS_TYPED(f)                                                      \
+  { #f, SHIM_TYPED(f), 0, NULL, 0, 0 }
+
+#endif
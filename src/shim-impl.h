@@ -24,22 +24,64 @@
 #ifndef NODE_SHIM_IMPL_H
 #define NODE_SHIM_IMPL_H
 
+#include "uv.h"
+#include "queue.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+/* the wrapper was malloc'd and is released by shim_value_release */
+#define SHIM_VAL_HEAP   0x0
+/* the wrapper belongs to a context arena and is released with the context */
+#define SHIM_VAL_ARENA  0x1
+/* the wrapper is a singleton and is never released */
+#define SHIM_VAL_STATIC 0x2
+/* the bits above that say who owns the wrapper */
+#define SHIM_VAL_OWNER  0x3
+/* type is the exact classification of the value, and num holds it unboxed
+ * for SHIM_TYPE_INT32 and SHIM_TYPE_NUMBER */
+#define SHIM_VAL_EXACT  0x4
+
+
 struct shim_val_s {
   void* handle;
   enum shim_type type;
+  uint32_t flags;
+  double num;
 };
 
 
+/* number of wrappers in each arena chunk */
+#define SHIM_ARENA_CHUNK 32
+
+
+typedef struct shim_arena_chunk_s {
+  struct shim_arena_chunk_s* next;
+  size_t used;
+  shim_val_t vals[SHIM_ARENA_CHUNK];
+} shim_arena_chunk_t;
+
+
+/*
+ * Bump allocator for the wrappers created during a single boundary call, the
+ * first chunk lives in the frame that owns the context so most calls never
+ * touch the heap
+ */
+typedef struct shim_arena_s {
+  shim_arena_chunk_t* cur;
+  shim_arena_chunk_t first;
+} shim_arena_t;
+
+
 struct shim_ctx_s {
   void* scope;
   void* isolate;
   void* trycatch;
   void* allocs;
+  /* what the shim caches for this isolate, see shim_isolate_state() */
+  void* state;
 };
 
 
@@ -52,10 +94,93 @@ struct shim_args_s {
 };
 
 
+/*
+ * node of an intrusive lock free multiple producer single consumer list, the
+ * messages of a shim_async_t are linked through one directly
+ */
+typedef shim_async_msg_t shim_mpsc_node_t;
+
+
+#if UV_VERSION_MAJOR >= 1
+# define SHIM_ASYNC_CB(name, handle) void name(uv_async_t* handle)
+#else
+# define SHIM_ASYNC_CB(name, handle) void name(uv_async_t* handle, int status)
+#endif
+
+
 struct shim_work_s {
+  uv_work_t req;
+  /* the isolate that queued the job, its after callback runs there */
+  struct shim_isolate_s* state;
   shim_work_cb work_cb;
   shim_after_work after_cb;
   void* hint;
+  /* the batch this job belongs to, NULL for single jobs and batch heads */
+  struct shim_work_s* batch;
+  /* position in the batch, or jobs still outstanding for a batch head */
+  size_t index;
+  size_t remaining;
+  int status;
+  /* set by shim_work_cancel, polled by the job itself */
+  volatile int cancelled;
+  /* TRUE once handed to uv_queue_work, so uv_cancel may be tried */
+  int submitted;
+  volatile size_t progress;
+  /* uv_hrtime() when queued, 0 unless stats were being counted */
+  uint64_t queued_at;
+  /* linkage in the free list, the pending list or a worker deque */
+  QUEUE queue;
+  /* a batch head's unfinished members, or a member's linkage in them */
+  QUEUE members;
+  /* the shim pool running this job, NULL for the libuv threadpool */
+  struct shim_pool_s* pool;
+  /* linkage in the pool's completion list */
+  shim_mpsc_node_t done;
+  /* set for jobs queued by shim_queue_work_promise() */
+  shim_resolve_cb resolve_cb;
+  shim_handle_t resolver;
+};
+
+
+#define SHIM_PRIORITY_COUNT 2
+
+
+/*
+ * Each worker owns a queue per priority. It takes the oldest job from its
+ * own queues and steals from the front of the others' when they run dry.
+ */
+typedef struct shim_worker_s {
+  uv_thread_t thread;
+  uv_mutex_t lock;
+  QUEUE jobs[SHIM_PRIORITY_COUNT];
+  struct shim_pool_s* pool;
+} shim_worker_t;
+
+
+struct shim_pool_s {
+  uv_async_t async;
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  /* jobs not yet picked up by a worker, updated atomically */
+  volatile size_t queued;
+  /* jobs whose after callback hasn't run, main thread only */
+  size_t inflight;
+  /* the next worker to hand a job to, main thread only */
+  size_t next;
+  int stopping;
+  shim_mpsc_node_t* volatile done;
+  size_t nworkers;
+  shim_worker_t* workers;
+};
+
+
+struct shim_async_s {
+  uv_async_t async;
+  shim_mpsc_node_t* volatile pending;
+  volatile int closing;
+  shim_callback_t* func;
+  shim_async_convert convert_cb;
+  void* hint;
 };
 
 
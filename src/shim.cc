@@ -21,7 +21,9 @@
  * USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <cmath>
 #include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
@@ -38,8 +40,203 @@
 #include "node.h"
 #include "node_buffer.h"
 
+/* the widest vector unit the compiler was told it may use */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define SHIM_SIMD_AVX2 1
+# define SHIM_SIMD_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define SHIM_SIMD_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+# define SHIM_SIMD_NEON 1
+#endif
+
+
+struct shim_atom_s {
+  v8::Persistent<v8::String> str;
+  char* name;
+  struct shim_atom_s* next;
+};
+
+
+struct shim_shape_s {
+  v8::Persistent<v8::ObjectTemplate> tmpl;
+  v8::Persistent<v8::Object> boilerplate;
+  size_t n;
+  shim_atom_t** atoms;
+  struct shim_shape_s* next;
+};
+
+
+#define SHIM_HANDLE_SLAB 1024
+
+/* a slot holds its persistent and, inline, what used to be a weak baton */
+typedef struct shim_handle_slot_s {
+  v8::Persistent<v8::Value> obj;
+  shim_weak_cb weak_cb;
+  void* data;
+  struct shim_handle_table_s* table;
+  /* one based position in the table */
+  uint32_t index;
+  /* bumped each time the slot is released */
+  uint32_t gen;
+  /* index of the next free slot when unused, 0 ends the list */
+  uint32_t next_free;
+  int used;
+} shim_handle_slot_t;
+
+
+#define SHIM_HANDLE_ID(slot)                                                  \
+  ((static_cast<shim_handle_t>((slot)->gen) << 32) | (slot)->index)
+
+
+struct shim_handle_table_s {
+  shim_handle_slot_t** slabs;
+  size_t nslabs;
+  uint32_t free_head;
+  size_t live;
+};
+
+
+/* what a shim_error_desc_t has interned in one isolate */
+struct shim_error_cache_s {
+  const shim_error_desc_t* desc;
+  shim_atom_t* message;
+  shim_atom_t* code;
+  /* the shared error of a SHIM_ERROR_NOSTACK descriptor */
+  v8::Persistent<v8::Value> error;
+  struct shim_error_cache_s* next;
+};
+
+
+/*
+ * Functions are cached by (cfunc, data, flags, name) for as long as they are
+ * alive, a holder lives as long as its function. The table starts with this
+ * many buckets and doubles whenever it holds more functions than buckets.
+ */
+#define SHIM_FCACHE_SIZE 256
+
+#define SHIM_ERRORS_SIZE 64
+
+
+/*
+ * Everything the shim caches that belongs to an isolate. Each isolate the
+ * module is loaded into gets its own, so several can run it in parallel.
+ */
+struct shim_isolate_s {
+  v8::Isolate* isolate;
+  v8::Persistent<v8::String> hidden_private;
+  /* where shim_arraybuffer_data() keeps the byte view of an ArrayBuffer */
+  v8::Persistent<v8::String> hidden_view;
+  struct shim_atom_s* atoms;
+  struct shim_shape_s* shapes;
+  struct shim_class_s* classes;
+  struct shim_fholder_s** fcache;
+  size_t fcache_size;
+  size_t fcache_count;
+  struct shim_error_cache_s* errors[SHIM_ERRORS_SIZE];
+  /* how long shim_initialize() took, and what it left to make lazily */
+  uint64_t init_nanos;
+  uint64_t lazy_pending;
+  uint64_t lazy_created;
+  /* resolvers of pending shim_queue_work_promise() jobs */
+  shim_handle_table_t* promises;
+  /* settles a resolver when called through node::MakeCallback() */
+  v8::Persistent<v8::Function> promise_settle;
+  /* where jobs, pools and channels made in this isolate complete */
+  uv_loop_t* loop;
+  /*
+   * Work requests are recycled through a free list, and at most work_limit
+   * of them are handed to libuv at once, the rest wait in work_pending.
+   */
+  QUEUE work_free;
+  QUEUE work_pending;
+  size_t work_free_count;
+  size_t work_pending_count;
+  size_t work_inflight;
+  size_t work_limit;
+  struct shim_isolate_s* next;
+};
+
+
+typedef struct shim_buffer_chunk_s {
+  struct shim_buffer_chunk_s* next;
+  size_t size;
+  char data[1];
+} shim_buffer_chunk_t;
+
+
+struct shim_buffer_writer_s {
+  /* chunks filled since the last shim_buffer_writer_chunks() */
+  v8::Persistent<v8::Array> chunks;
+  uint32_t nchunks;
+  shim_buffer_chunk_t* cur;
+  size_t used;
+  /* what the last shim_buffer_writer_reserve() handed out */
+  size_t reserved;
+  size_t chunk_size;
+  size_t total;
+};
+
+
+struct shim_buffer_reader_s {
+  /* a copy of the array it was given, so later changes to that don't count */
+  v8::Persistent<v8::Array> chunks;
+  uint32_t nchunks;
+  uint32_t next;
+  /* the chunk being read */
+  char* data;
+  size_t len;
+  size_t off;
+  size_t remaining;
+};
+
+
+struct shim_scope_s {
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+  v8::EscapableHandleScope scope;
+  explicit shim_scope_s(v8::Isolate* isolate) : scope(isolate) {}
+#else
+  v8::HandleScope scope;
+#endif
+  /* where the arena was when the scope was opened */
+  shim_arena_chunk_t* chunk;
+  size_t used;
+};
+
+
+struct shim_callback_s {
+  v8::Persistent<v8::Function> func;
+  /* empty when calls use the default receiver */
+  v8::Persistent<v8::Object> recv;
+};
+
+
 namespace shim {
 
+/* Promise::Resolver and Isolate::RunMicrotasks() arrived with 3.26 */
+#if NODE_VERSION_AT_LEAST(0, 11, 14)
+# define SHIM_PROMISES 1
+#else
+# define SHIM_PROMISES 0
+#endif
+
+/* one byte strings can be made and read without the UTF-8 codec */
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+# define SHIM_ONE_BYTE_STRINGS 1
+#else
+# define SHIM_ONE_BYTE_STRINGS 0
+#endif
+
+/* V8 grew a native typed array API with the 3.19 series */
+#if NODE_VERSION_AT_LEAST(0, 11, 5)
+# define SHIM_NATIVE_TYPED_ARRAYS 1
+#else
+# define SHIM_NATIVE_TYPED_ARRAYS 0
+#endif
+
 #if NODE_VERSION_AT_LEAST(0, 11, 3)
 using v8::FunctionCallbackInfo;
 #else
@@ -48,6 +245,7 @@ using v8::Arguments;
 #endif
 
 using v8::Array;
+using v8::Boolean;
 using v8::Exception;
 using v8::External;
 using v8::Function;
@@ -60,6 +258,7 @@ using v8::Local;
 using v8::Number;
 using v8::Null;
 using v8::Object;
+using v8::ObjectTemplate;
 using v8::Persistent;
 using v8::String;
 using v8::TryCatch;
@@ -71,99 +270,513 @@ using v8::Value;
   Isolate* ctx ## _isolate = Isolate::GetCurrent();                           \
   HandleScope ctx ## _scope;                                                  \
   TryCatch ctx ## _trycatch;                                                  \
+  shim_arena_t ctx ## _arena;                                                 \
+  shim_arena_init(&ctx ## _arena);                                            \
   shim_ctx_t ctx;                                                             \
   ctx.isolate = static_cast<void*>(ctx ## _isolate);                          \
   ctx.scope = static_cast<void*>(&ctx ## _scope);                             \
   ctx.trycatch = static_cast<void*>(&ctx ## _trycatch);                       \
+  ctx.allocs = static_cast<void*>(&ctx ## _arena);                            \
+  ctx.state = static_cast<void*>(shim_isolate_state(ctx ## _isolate));        \
 do {} while(0)
 
+#define SHIM_STATE(ctx) static_cast<shim_isolate_s*>((ctx)->state)
+
 
 #define SHIM_TO_VAL(obj) Local<Value>(static_cast<Value*>((obj)->handle))
 
 #define VAL_DEFINE(var, obj) Local<Value> var(SHIM_TO_VAL(obj))
 
-#if 0
-#define SHIM_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+/* repoint a caller's wrapper, whatever was known about the old value goes */
+#define SHIM_VAL_SET(obj, h)                                                  \
+  do {                                                                        \
+    (obj)->handle = (h);                                                      \
+    (obj)->type = SHIM_TYPE_UNKNOWN;                                          \
+    (obj)->flags &= ~SHIM_VAL_EXACT;                                          \
+  } while(0)
+
+/* the number was unboxed when the value was classified */
+#define SHIM_VAL_UNBOXED(obj)                                                 \
+  (((obj)->flags & SHIM_VAL_EXACT)                                            \
+   && ((obj)->type == SHIM_TYPE_INT32 || (obj)->type == SHIM_TYPE_NUMBER))
+
+/* work latency is bucketed by log2 of nanoseconds */
+#define SHIM_STATS_BUCKETS 40
+
+typedef struct shim_stats_s {
+  uint64_t wrappers;
+  uint64_t exceptions;
+  uint64_t work_latency[SHIM_STATS_BUCKETS];
+} shim_stats_t;
+
+
+int stats_flags = SHIM_STATS_OFF;
+/* shared by every isolate, so counted atomically */
+shim_stats_t stats;
+
+/* every hook is a single branch on stats_flags while disabled */
+#define SHIM_STATS(stmt)                                                      \
+  do { if (stats_flags & SHIM_STATS_COUNT) { stmt; } } while(0)
+
+#define SHIM_TRACE(...)                                                       \
+  do {                                                                        \
+    if (stats_flags & SHIM_STATS_TRACE)                                       \
+      fprintf(stderr, __VA_ARGS__);                                           \
+  } while(0)
+
+
+void
+shim_stats_latency(uint64_t start)
+{
+  uint64_t ns = uv_hrtime() - start;
+  size_t b = 0;
+
+  while (ns > 1 && b < SHIM_STATS_BUCKETS - 1) {
+    ns >>= 1;
+    b++;
+  }
+
+  __sync_fetch_and_add(&stats.work_latency[b], 1);
+}
+
+#if defined(_MSC_VER)
+# define SHIM_THREAD_LOCAL __declspec(thread)
+#else
+# define SHIM_THREAD_LOCAL __thread
+#endif
+
+/* states are only released by shim_isolate_dispose() */
+uv_once_t states_once = UV_ONCE_INIT;
+uv_mutex_t states_lock;
+shim_isolate_s* states = NULL;
+
+/* an isolate stays on one thread, so its state is looked up once there */
+SHIM_THREAD_LOCAL shim_isolate_s* current_state = NULL;
+
+
+void
+shim_states_init()
+{
+  uv_mutex_init(&states_lock);
+}
+
+
+shim_isolate_s*
+shim_isolate_state(Isolate* isolate)
+{
+  shim_isolate_s* state = current_state;
+
+  if (state != NULL && state->isolate == isolate)
+    return state;
+
+  uv_once(&states_once, shim_states_init);
+  uv_mutex_lock(&states_lock);
+
+  for (state = states; state != NULL; state = state->next)
+    if (state->isolate == isolate)
+      break;
+
+  if (state == NULL) {
+    state = new shim_isolate_s;
+    state->isolate = isolate;
+    state->atoms = NULL;
+    state->shapes = NULL;
+    state->classes = NULL;
+    state->fcache = static_cast<shim_fholder_s**>(
+      calloc(SHIM_FCACHE_SIZE, sizeof(shim_fholder_s*)));
+    state->fcache_size = SHIM_FCACHE_SIZE;
+    state->fcache_count = 0;
+    memset(state->errors, 0, sizeof(state->errors));
+    state->init_nanos = 0;
+    state->lazy_pending = 0;
+    state->lazy_created = 0;
+    state->promises = NULL;
+    state->loop = uv_default_loop();
+    QUEUE_INIT(&state->work_free);
+    QUEUE_INIT(&state->work_pending);
+    state->work_free_count = 0;
+    state->work_pending_count = 0;
+    state->work_inflight = 0;
+    state->work_limit = 0;
+
+    Local<String> str = String::NewSymbol("shim_private");
+    Local<String> view = String::NewSymbol("shim_view");
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+    state->hidden_private = Persistent<String>::New(isolate, str);
+    state->hidden_view = Persistent<String>::New(isolate, view);
 #else
-#define SHIM_DEBUG(...)
+    state->hidden_private = Persistent<String>::New(str);
+    state->hidden_view = Persistent<String>::New(view);
 #endif
 
-Persistent<String> hidden_private;
+    state->next = states;
+    states = state;
+  }
+
+  uv_mutex_unlock(&states_lock);
+
+  current_state = state;
+  return state;
+}
+
+#define ATOM_TO_STR(atom) Local<String>(*(atom)->str)
 
 shim_val_t shim__undefined = {
   NULL,
   SHIM_TYPE_UNDEFINED,
+  SHIM_VAL_STATIC | SHIM_VAL_EXACT,
+  0,
 };
 
 shim_val_t shim__null = {
   NULL,
   SHIM_TYPE_NULL,
+  SHIM_VAL_STATIC | SHIM_VAL_EXACT,
+  0,
 };
 
+
+/* spare chunks are kept per thread, and so per isolate */
+#define SHIM_ARENA_FREE_MAX 16
+
+SHIM_THREAD_LOCAL shim_arena_chunk_t* arena_free_list = NULL;
+SHIM_THREAD_LOCAL size_t arena_free_count = 0;
+
+void
+shim_arena_init(shim_arena_t* arena)
+{
+  arena->first.next = NULL;
+  arena->first.used = 0;
+  arena->cur = &arena->first;
+}
+
+
+shim_val_t*
+shim_arena_alloc(shim_arena_t* arena)
+{
+  shim_arena_chunk_t* chunk = arena->cur;
+
+  if (chunk->used == SHIM_ARENA_CHUNK) {
+    if (arena_free_list != NULL) {
+      chunk = arena_free_list;
+      arena_free_list = chunk->next;
+      arena_free_count--;
+    } else {
+      chunk = static_cast<shim_arena_chunk_t*>(
+        malloc(sizeof(shim_arena_chunk_t)));
+    }
+
+    chunk->next = arena->cur;
+    chunk->used = 0;
+    arena->cur = chunk;
+  }
+
+  return &chunk->vals[chunk->used++];
+}
+
+
+/* return the chunks taken since mark, and the slots of mark past used */
+void
+shim_arena_rewind(shim_arena_t* arena, shim_arena_chunk_t* mark, size_t used)
+{
+  shim_arena_chunk_t* chunk = arena->cur;
+
+  while (chunk != mark) {
+    shim_arena_chunk_t* next = chunk->next;
+
+    if (arena_free_count < SHIM_ARENA_FREE_MAX) {
+      chunk->next = arena_free_list;
+      arena_free_list = chunk;
+      arena_free_count++;
+    } else {
+      free(chunk);
+    }
+
+    chunk = next;
+  }
+
+  mark->used = used;
+  arena->cur = mark;
+}
+
+
+void
+shim_arena_reset(shim_arena_t* arena)
+{
+  shim_arena_rewind(arena, &arena->first, 0);
+}
+
+
 void
 shim_context_cleanup(shim_ctx_t* ctx)
 {
+  if (ctx->allocs != NULL)
+    shim_arena_reset(static_cast<shim_arena_t*>(ctx->allocs));
 }
 
 
+/*
+ * Wrappers are carved from the context arena when there is one, values that
+ * must outlive the context (persistents, or those created without a context)
+ * come from the heap
+ */
 shim_val_t*
 shim_val_alloc(shim_ctx_t* ctx, Handle<Value> val,
   shim_type_t type = SHIM_TYPE_UNKNOWN)
 {
-  shim_val_t* obj = static_cast<shim_val_t*>(malloc(sizeof(shim_val_t)));
+  shim_val_t* obj;
+
+  if (ctx != NULL && ctx->allocs != NULL) {
+    obj = shim_arena_alloc(static_cast<shim_arena_t*>(ctx->allocs));
+    obj->flags = SHIM_VAL_ARENA;
+  } else {
+    obj = static_cast<shim_val_t*>(malloc(sizeof(shim_val_t)));
+    obj->flags = SHIM_VAL_HEAP;
+  }
+
   obj->handle = *val;
   obj->type = type;
+  SHIM_STATS(__sync_fetch_and_add(&stats.wrappers, 1));
   return obj;
 }
 
-Local<Value>*
-shim_vals_to_handles(size_t argc, shim_val_t** argv)
+
+/* Fill a wrapper whose storage is owned by the calling frame */
+shim_val_t*
+shim_val_init(shim_val_t* obj, Handle<Value> val,
+  shim_type_t type = SHIM_TYPE_UNKNOWN)
 {
-  Local<Value>* jsargs = new Local<Value>[argc];
+  obj->handle = *val;
+  obj->type = type;
+  obj->flags = SHIM_VAL_ARENA;
+  return obj;
+}
 
-  for (size_t i = 0; i < argc; i++) {
-    if (argv[i] == NULL) {
-      jsargs[i] = *Null();
-      continue;
-    }
 
-    Local<Value> tmp;
+/*
+ * Smis are told apart by their tag alone, without calling into V8. Define
+ * SHIM_NO_V8_INTERNALS to use the public API instead.
+ */
+inline bool
+shim_val_smi(Local<Value> v, int32_t* out)
+{
+#ifndef SHIM_NO_V8_INTERNALS
+  typedef v8::internal::Object I;
+  I* obj = *reinterpret_cast<I**>(*v);
+  if (v8::internal::Internals::HasHeapObjectTag(obj))
+    return false;
+  *out = v8::internal::Internals::SmiValue(obj);
+  return true;
+#else
+  if (!v->IsInt32())
+    return false;
+  *out = v->Int32Value();
+  return true;
+#endif
+}
+
 
-    switch(argv[i]->type) {
-      case SHIM_TYPE_UNDEFINED:
-        tmp = *Undefined();
-        break;
-      case SHIM_TYPE_NULL:
-        tmp = *Null();
-        break;
-      default:
-        tmp = SHIM_TO_VAL(argv[i]);
-        break;
-    }
+/*
+ * Classify an incoming value once, the cheapest checks first. Primitives get
+ * their exact type, and numbers their unboxed value, so that later type
+ * checks and conversions don't go back into V8. Objects are left for
+ * shim_value_is() to look at on demand.
+ */
+shim_val_t*
+shim_val_classify(shim_val_t* obj)
+{
+  Local<Value> v = SHIM_TO_VAL(obj);
+  int32_t smi;
+
+  if (shim_val_smi(v, &smi)) {
+    obj->type = SHIM_TYPE_INT32;
+    obj->num = smi;
+  } else if (v->IsString()) {
+    obj->type = SHIM_TYPE_STRING;
+  } else if (v->IsNumber()) {
+    obj->type = SHIM_TYPE_NUMBER;
+    obj->num = v->NumberValue();
+  } else if (v->IsUndefined()) {
+    obj->type = SHIM_TYPE_UNDEFINED;
+  } else if (v->IsNull()) {
+    obj->type = SHIM_TYPE_NULL;
+  } else if (v->IsBoolean()) {
+    obj->type = SHIM_TYPE_BOOL;
+  } else {
+    return obj;
+  }
+
+  obj->flags |= SHIM_VAL_EXACT;
+  return obj;
+}
+
+
+/* whether an unboxed number also passes as an int32 or uint32 */
+inline bool
+shim_num_is_int32(double d)
+{
+  return d >= -2147483648.0 && d <= 2147483647.0
+    && d == static_cast<int32_t>(d) && !(d == 0 && std::signbit(d));
+}
+
+
+inline bool
+shim_num_is_uint32(double d)
+{
+  return d >= 0 && d <= 4294967295.0
+    && d == static_cast<uint32_t>(d) && !(d == 0 && std::signbit(d));
+}
+
+
+/*
+ * Casting a double that doesn't fit to an integer type is undefined, so
+ * stores and unboxed reads convert the way JS does. ToUint32 takes the
+ * integer part modulo 2^32, with NaN and the infinities becoming 0, and the
+ * narrower types keep its low bits.
+ */
+uint32_t
+shim_num_to_uint32(double d)
+{
+  if (!(d > -4294967296.0 && d < 4294967296.0)) {
+    if (!(d == d) || d == HUGE_VAL || d == -HUGE_VAL)
+      return 0;
+    d = std::fmod(d, 4294967296.0);
+  }
+
+  d = d < 0 ? std::ceil(d) : std::floor(d);
+  if (d < 0)
+    d += 4294967296.0;
+
+  return static_cast<uint32_t>(d);
+}
+
+
+/* ToUint8Clamp, NaN is 0 and halves round to even */
+uint8_t
+shim_num_to_uint8_clamp(double d)
+{
+  if (!(d > 0))
+    return 0;
+  if (d >= 255)
+    return 255;
+
+  double f = std::floor(d);
+  if (d - f > 0.5 || (d - f == 0.5 && std::fmod(f, 2) != 0))
+    f += 1;
+
+  return static_cast<uint8_t>(f);
+}
+
+
+/* the integer part, saturated at the ends of the range and NaN as 0 */
+int64_t
+shim_num_to_int64(double d)
+{
+  if (!(d == d))
+    return 0;
+  if (d <= -9223372036854775808.0)
+    return static_cast<int64_t>(-9223372036854775808.0);
+  if (d >= 9223372036854775808.0)
+    return static_cast<int64_t>(~static_cast<uint64_t>(0) >> 1);
+
+  return static_cast<int64_t>(d);
+}
 
-    jsargs[i] = tmp;
+
+/* answer shim_value_is() for an exactly classified value */
+shim_bool_t
+shim_val_exact_is(shim_val_t* val, shim_type_t type)
+{
+  switch (val->type) {
+    case SHIM_TYPE_INT32:
+    case SHIM_TYPE_NUMBER:
+      switch (type) {
+        case SHIM_TYPE_NUMBER:
+        case SHIM_TYPE_INTEGER:
+          return TRUE;
+        case SHIM_TYPE_INT32:
+          return shim_num_is_int32(val->num);
+        case SHIM_TYPE_UINT32:
+          return shim_num_is_uint32(val->num);
+        default:
+          return FALSE;
+      }
+    default:
+      /* strings, booleans, undefined and null are nothing but themselves */
+      return FALSE;
   }
+}
+
+
+shim_val_t*
+shim_val_alloc_heap(Handle<Value> val, shim_type_t type = SHIM_TYPE_UNKNOWN)
+{
+  return shim_val_alloc(NULL, val, type);
+}
+
+Local<Value>
+shim_val_handle(shim_val_t* val)
+{
+  if (val == NULL)
+    return Local<Value>(*Null());
 
-  return jsargs;
+  switch(val->type) {
+    case SHIM_TYPE_UNDEFINED:
+      return Local<Value>(*Undefined());
+    case SHIM_TYPE_NULL:
+      return Local<Value>(*Null());
+    default:
+      return SHIM_TO_VAL(val);
+  }
 }
 
 
-enum shim_err_type {
-  SHIM_ERR_ERROR,
-  SHIM_ERR_TYPE,
-  SHIM_ERR_RANGE,
+#define SHIM_CALL_ARGV_INLINE 8
+
+/*
+ * Arguments for a call into JS, calls of up to SHIM_CALL_ARGV_INLINE
+ * arguments keep their handles on the stack
+ */
+class HandleArgs {
+ public:
+  HandleArgs(size_t argc, shim_val_t** argv) {
+    if (argc > SHIM_CALL_ARGV_INLINE)
+      handles_ = new Local<Value>[argc];
+    else
+      handles_ = inline_;
+
+    for (size_t i = 0; i < argc; i++)
+      handles_[i] = shim_val_handle(argv[i]);
+  }
+
+  ~HandleArgs() {
+    if (handles_ != inline_)
+      delete[] handles_;
+  }
+
+  Local<Value>* operator*() { return handles_; }
+
+ private:
+  Local<Value>* handles_;
+  Local<Value> inline_[SHIM_CALL_ARGV_INLINE];
 };
 
-/* TODO this doesn't belong here */
-#define SHIM_ERROR_LENGTH 512
+
+/*
+ * The receiver used when calling out without a this. A sloppy mode callee
+ * sees the global object there anyway, so nothing is allocated per call and
+ * no object is shared between unrelated callees.
+ */
+Local<Object>
+shim_default_receiver(shim_ctx_t* ctx)
+{
+  return v8::Context::GetCurrent()->Global();
+}
+
 
 Local<Value>
-shim_format_error(shim_ctx_t* ctx, enum shim_err_type type, const char* msg,
-  va_list ap)
+shim_error_make(shim_error_kind_t type, Local<String> str)
 {
-  char buf[SHIM_ERROR_LENGTH];
-  vsnprintf(buf, SHIM_ERROR_LENGTH, msg, ap);
-  Local<String> str = String::New(buf);
   Local<Value> err;
   switch(type) {
     case SHIM_ERR_ERROR:
@@ -179,14 +792,25 @@ shim_format_error(shim_ctx_t* ctx, enum shim_err_type type, const char* msg,
   return err;
 }
 
+/* TODO this doesn't belong here */
+#define SHIM_ERROR_LENGTH 512
+
+Local<Value>
+shim_format_error(shim_ctx_t* ctx, shim_error_kind_t type, const char* msg,
+  va_list ap)
+{
+  char buf[SHIM_ERROR_LENGTH];
+  vsnprintf(buf, SHIM_ERROR_LENGTH, msg, ap);
+  return shim_error_make(type, String::New(buf));
+}
+
 
 Local<Value>
 shim_call_func(Local<Object> recv, Local<Function> fn, size_t argc,
   shim_val_t** argv)
 {
-  Local<Value>* jsargs = shim_vals_to_handles(argc, argv);
-  Local<Value> ret = fn->Call(recv, argc, jsargs);
-  delete jsargs;
+  HandleArgs jsargs(argc, argv);
+  Local<Value> ret = fn->Call(recv, argc, *jsargs);
   return ret;
 }
 
@@ -205,135 +829,540 @@ shim_call_func(Local<Object> recv, Local<String> str, size_t argc,
 struct shim_fholder_s {
   shim_func cfunc;
   void* data;
+  int32_t flags;
+  char* name;
+  struct shim_isolate_s* state;
+  /* only class constructors keep their template, see shim_class_new() */
+  Persistent<FunctionTemplate> tmpl;
+  /* weak, except for class constructors */
+  Persistent<Value> func;
+  /* set for class constructors, see shim_class_new() */
+  struct shim_class_s* klass;
+  uint64_t calls;
+  uint64_t nanos;
+  uint64_t throws;
+  struct shim_fholder_s* next;
 };
 
 
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-void
-Static(const FunctionCallbackInfo<Value>& args)
+/*
+ * Instances of a class carry their private pointer, the class and, once
+ * registered for finalization, their handle in internal fields
+ */
+#define SHIM_CLASS_FIELDS 4
+#define SHIM_CLASS_FIELD_DATA 0
+#define SHIM_CLASS_FIELD_CLASS 1
+#define SHIM_CLASS_FIELD_HANDLE 2
+#define SHIM_CLASS_FIELD_SIZE 3
+
+/* integers kept in internal fields are shifted so they pass for pointers */
+#define SHIM_FIELD_FROM_SIZE(n)                                               \
+  reinterpret_cast<void*>(static_cast<uintptr_t>(n) << 1)
+#define SHIM_FIELD_TO_SIZE(p)                                                 \
+  static_cast<size_t>(reinterpret_cast<uintptr_t>(p) >> 1)
+
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+# define SHIM_SET_FIELD(obj, i, p) (obj)->SetAlignedPointerInInternalField(i, p)
+# define SHIM_GET_FIELD(obj, i) (obj)->GetAlignedPointerFromInternalField(i)
 #else
-Handle<Value>
-Static(const Arguments& args)
+# define SHIM_SET_FIELD(obj, i, p) (obj)->SetPointerInInternalField(i, p)
+# define SHIM_GET_FIELD(obj, i) (obj)->GetPointerFromInternalField(i)
 #endif
-{
-  String::Utf8Value fname(args.Callee()->GetName());
-  SHIM_DEBUG("SHIM ENTER %s\n", *fname);
-  SHIM_PROLOGUE(ctx);
 
-  Local<Value> data = args.Data();
 
-  assert(data->IsExternal());
+struct shim_class_s {
+  shim_fholder_s* holder;
+  shim_finalize_cb finalize_cb;
+  void* hint;
+  shim_handle_table_t* instances;
+  struct shim_class_s* next;
+};
+
+
+void
+shim_class_adopt(struct shim_class_s* klass, Local<Object> self)
+{
+  if (!Local<FunctionTemplate>(*klass->holder->tmpl)->HasInstance(self))
+    return;
+
+  SHIM_SET_FIELD(self, SHIM_CLASS_FIELD_DATA, NULL);
+  SHIM_SET_FIELD(self, SHIM_CLASS_FIELD_CLASS, klass);
+  SHIM_SET_FIELD(self, SHIM_CLASS_FIELD_HANDLE, NULL);
+  SHIM_SET_FIELD(self, SHIM_CLASS_FIELD_SIZE, NULL);
+}
+
+
+/*
+ * The class made by shim_class_new() that obj is an instance of, or NULL.
+ * Other addons make objects with internal fields too, so the count alone
+ * doesn't say whose fields they are.
+ */
+struct shim_class_s*
+shim_class_of(shim_isolate_s* state, Local<Object> obj)
+{
+  if (obj->InternalFieldCount() != SHIM_CLASS_FIELDS)
+    return NULL;
+
+  for (struct shim_class_s* klass = state->classes; klass != NULL;
+      klass = klass->next) {
+    if (Local<FunctionTemplate>(*klass->holder->tmpl)->HasInstance(obj))
+      return klass;
+  }
+
+  return NULL;
+}
+
+
+int64_t
+shim_external_adjust(Isolate* isolate, int64_t delta)
+{
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+  return isolate->AdjustAmountOfExternalAllocatedMemory(delta);
+#else
+  return v8::V8::AdjustAmountOfExternalAllocatedMemory(delta);
+#endif
+}
+
+
+size_t
+shim_fcache_hash(shim_func cfunc, void* data, int32_t flags, size_t size)
+{
+  uintptr_t h = reinterpret_cast<uintptr_t>(cfunc) >> 4;
+  h ^= reinterpret_cast<uintptr_t>(data) >> 3;
+  h ^= static_cast<uintptr_t>(flags) * 31;
+  return (h ^ (h >> 8) ^ (h >> 16)) & (size - 1);
+}
+
+
+shim_fholder_s*
+shim_fcache_find(shim_isolate_s* state, shim_func cfunc, void* data,
+  int32_t flags, const char* name)
+{
+  shim_fholder_s* cur = state->fcache[shim_fcache_hash(cfunc, data, flags,
+    state->fcache_size)];
+
+  for (; cur != NULL; cur = cur->next) {
+    if (cur->cfunc != cfunc || cur->data != data || cur->flags != flags)
+      continue;
+
+    if (cur->name == name
+        || (cur->name != NULL && name != NULL && strcmp(cur->name, name) == 0))
+      return cur;
+  }
+
+  return NULL;
+}
+
+
+/* keep chains short however many closures are alive at once */
+void
+shim_fcache_grow(shim_isolate_s* state)
+{
+  size_t size = state->fcache_size * 2;
+  shim_fholder_s** table = static_cast<shim_fholder_s**>(
+    calloc(size, sizeof(shim_fholder_s*)));
+
+  for (size_t i = 0; i < state->fcache_size; i++) {
+    while (state->fcache[i] != NULL) {
+      shim_fholder_s* holder = state->fcache[i];
+      state->fcache[i] = holder->next;
+
+      size_t bucket = shim_fcache_hash(holder->cfunc, holder->data,
+        holder->flags, size);
+      holder->next = table[bucket];
+      table[bucket] = holder;
+    }
+  }
+
+  free(state->fcache);
+  state->fcache = table;
+  state->fcache_size = size;
+}
+
+
+void
+shim_fcache_insert(shim_isolate_s* state, shim_fholder_s* holder)
+{
+  if (state->fcache_count >= state->fcache_size)
+    shim_fcache_grow(state);
+
+  size_t bucket = shim_fcache_hash(holder->cfunc, holder->data, holder->flags,
+    state->fcache_size);
+  holder->next = state->fcache[bucket];
+  state->fcache[bucket] = holder;
+  state->fcache_count++;
+}
+
+
+void
+shim_fcache_remove(shim_fholder_s* holder)
+{
+  shim_isolate_s* state = holder->state;
+  shim_fholder_s** cur = &state->fcache[shim_fcache_hash(holder->cfunc,
+    holder->data, holder->flags, state->fcache_size)];
+
+  while (*cur != NULL) {
+    if (*cur == holder) {
+      *cur = holder->next;
+      state->fcache_count--;
+      break;
+    }
+    cur = &(*cur)->next;
+  }
+}
+
+
+void
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+shim_fholder_weak_cb(Isolate* iso, Persistent<Value>* pobj,
+  shim_fholder_s* holder)
+{
+#else
+shim_fholder_weak_cb(Persistent<Value> obj, void* data)
+{
+  shim_fholder_s* holder = static_cast<shim_fholder_s*>(data);
+#endif
+  shim_fcache_remove(holder);
+  holder->func.Dispose();
+  free(holder->name);
+  delete holder;
+}
+
+
+/* calls with up to this many arguments don't allocate their argv */
+#define SHIM_ARGV_INLINE 8
+
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+void
+Static(const FunctionCallbackInfo<Value>& args)
+#else
+Handle<Value>
+Static(const Arguments& args)
+#endif
+{
+  SHIM_PROLOGUE(ctx);
+
+  Local<Value> data = args.Data();
+
+  assert(data->IsExternal());
 
   Local<External> ext = data.As<External>();
   shim_fholder_s* holder = reinterpret_cast<shim_fholder_s*>(ext->Value());
   shim_func cfunc = holder->cfunc;
 
+  if (holder->klass != NULL && args.IsConstructCall())
+    shim_class_adopt(holder->klass, args.This());
+
+  /* small arity calls keep `this` and their arguments in this frame */
+  shim_val_t self_val;
+  shim_val_t argv_vals[SHIM_ARGV_INLINE];
+  shim_val_t* argv_inline[SHIM_ARGV_INLINE];
+
   shim_args_t sargs;
   sargs.argc = args.Length();
-  sargs.argv = NULL;
+  sargs.argv = argv_inline;
   sargs.ret = shim_undefined();
-  sargs.self = shim_val_alloc(&ctx, args.This());
+  sargs.self = shim_val_init(&self_val, args.This());
   sargs.data = holder->data;
 
-  size_t argv_len = sizeof(shim_val_t*) * sargs.argc;
-
-  if (argv_len > 0)
-    sargs.argv = static_cast<shim_val_t**>(malloc(argv_len));
-
   size_t i;
 
-  for (i = 0; i < sargs.argc; i++) {
-    sargs.argv[i] = shim_val_alloc(&ctx, args[i]);
-  }
+  if (sargs.argc <= SHIM_ARGV_INLINE) {
+    for (i = 0; i < sargs.argc; i++)
+      sargs.argv[i] = shim_val_classify(shim_val_init(&argv_vals[i],
+        args[i]));
+  } else {
+    sargs.argv = static_cast<shim_val_t**>(
+      malloc(sizeof(shim_val_t*) * sargs.argc));
 
-  SHIM_DEBUG("SHIM CALL %s\n", *fname);
-  if(!cfunc(&ctx, &sargs)) {
-    SHIM_DEBUG("SHIM ERROR %s\n", *fname);
-    /* the function failed do we need to do any more checking of exceptions? */
+    for (i = 0; i < sargs.argc; i++)
+      sargs.argv[i] = shim_val_classify(shim_val_alloc(&ctx, args[i]));
   }
-  SHIM_DEBUG("SHIM EXIT %s\n", *fname);
 
-  Value* ret = NULL;
-
-  if(sargs.ret != NULL) {
-    switch(sargs.ret->type) {
-      case SHIM_TYPE_UNDEFINED:
-        ret = *Undefined();
-        break;
-      case SHIM_TYPE_NULL:
-        ret = *Null();
-        break;
-      default:
-        ret = static_cast<Value*>(sargs.ret->handle);
-        break;
-    }
-  } else {
-    ret = *Null();
+  uint64_t start = 0;
+  if (stats_flags != SHIM_STATS_OFF) {
+    SHIM_TRACE("SHIM CALL %s\n", holder->name ? holder->name : "(anonymous)");
+    start = uv_hrtime();
   }
 
-  assert(ret != NULL);
+  /* a pending exception, not the return value, decides whether we threw */
+  cfunc(&ctx, &sargs);
 
-  for (i = 0; i < sargs.argc; i++) {
-    shim_value_release(sargs.argv[i]);
+  if (stats_flags != SHIM_STATS_OFF) {
+    uint64_t elapsed = uv_hrtime() - start;
+    SHIM_STATS(holder->calls++; holder->nanos += elapsed);
+    SHIM_TRACE("SHIM EXIT %s %llu ns\n",
+      holder->name ? holder->name : "(anonymous)",
+      static_cast<unsigned long long>(elapsed));
   }
 
-  shim_value_release(sargs.self);
-
-  if (argv_len > 0)
+  if (sargs.argv != argv_inline)
     free(sargs.argv);
 
-  shim_context_cleanup(&ctx);
-
-  /* TODO sometimes things don't always propogate? */
   if (ctx_trycatch.HasCaught()) {
-    SHIM_DEBUG("SHIM THREW %s\n", *fname);
+    SHIM_STATS(__sync_fetch_and_add(&stats.exceptions, 1); holder->throws++);
+    shim_context_cleanup(&ctx);
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
     ctx_trycatch.ReThrow();
+    return;
+#else
+    return ctx_trycatch.ReThrow();
+#endif
   }
 
-  SHIM_DEBUG("SHIM LEAVING %s\n", *fname);
+  /* read the return value before the arena holding its wrapper is reset */
+  Value* ret;
+
+  if (sargs.ret == NULL || sargs.ret->type == SHIM_TYPE_NULL)
+    ret = *Null();
+  else if (sargs.ret->type == SHIM_TYPE_UNDEFINED)
+    ret = *Undefined();
+  else
+    ret = static_cast<Value*>(sargs.ret->handle);
+
+  shim_context_cleanup(&ctx);
+
 #if NODE_VERSION_AT_LEAST(0, 11, 3)
-  if (!ctx_trycatch.HasCaught())
-    args.GetReturnValue().Set(Local<Value>(ret));
+  args.GetReturnValue().Set(Local<Value>(ret));
 #else
-  if (ctx_trycatch.HasCaught()) {
-    return ctx_trycatch.Exception();
-  } else {
-    return ctx_scope.Close(Local<Value>(ret));
-  }
+  return ctx_scope.Close(Local<Value>(ret));
 #endif
 }
 
-extern "C"
+/*
+ * A lazily exported function starts out as an accessor carrying its
+ * shim_fspec_t. The first get makes the real function and puts it in place
+ * of the accessor, a set simply replaces it.
+ */
+void
+shim_lazy_replace(Local<Object> holder, Local<String> property,
+  Local<Value> value)
 {
+  holder->ForceDelete(property);
+  holder->Set(property, value);
+}
 
-void shim_module_initialize(Handle<Object> exports, Handle<Value> module)
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+void
+shim_lazy_get(Local<String> property,
+  const v8::PropertyCallbackInfo<Value>& info)
+#else
+Handle<Value>
+shim_lazy_get(Local<String> property, const v8::AccessorInfo& info)
+#endif
 {
   SHIM_PROLOGUE(ctx);
 
-  if (hidden_private.IsEmpty()) {
-    Handle<String> str = String::NewSymbol("shim_private");
+  const shim_fspec_t* spec = static_cast<const shim_fspec_t*>(
+    info.Data().As<External>()->Value());
+
+  shim_val_t* func = shim_func_new(&ctx, spec->cfunc, spec->nargs,
+    spec->flags, spec->name, spec->data);
+  Local<Value> fn = SHIM_TO_VAL(func);
+
+  /* only a read makes the function, a set never counts */
+  shim_lazy_replace(info.Holder(), property, fn);
+  SHIM_STATE(&ctx)->lazy_pending--;
+  SHIM_STATE(&ctx)->lazy_created++;
+  SHIM_TRACE("SHIM LAZY %s\n", spec->name);
+
+  shim_context_cleanup(&ctx);
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  info.GetReturnValue().Set(fn);
+#else
+  return ctx_scope.Close(fn);
+#endif
+}
+
+
 #if NODE_VERSION_AT_LEAST(0, 11, 3)
-    hidden_private = Persistent<String>::New(ctx_isolate, str);
+void
+shim_lazy_set(Local<String> property, Local<Value> value,
+  const v8::PropertyCallbackInfo<void>& info)
 #else
-    hidden_private = Persistent<String>::New(str);
+void
+shim_lazy_set(Local<String> property, Local<Value> value,
+  const v8::AccessorInfo& info)
 #endif
+{
+  HandleScope scope;
+
+  /* assigning through an object that inherits the export shadows it */
+  if (info.This() != info.Holder()) {
+    info.This()->ForceSet(property, value);
+    return;
   }
 
+  shim_lazy_replace(info.Holder(), property, value);
+}
+
+extern "C"
+{
+
+void shim_module_initialize(Handle<Object> exports, Handle<Value> module)
+{
+  SHIM_PROLOGUE(ctx);
+
+  uint64_t start = uv_hrtime();
+
   shim_val_t sexport;
   sexport.handle = *exports;
+  sexport.type = SHIM_TYPE_OBJECT;
+  sexport.flags = SHIM_VAL_STATIC;
 
   shim_val_t smodule;
   smodule.handle = *module;
+  smodule.type = SHIM_TYPE_UNKNOWN;
+  smodule.flags = SHIM_VAL_STATIC;
 
   if (!shim_initialize(&ctx, &sexport, &smodule)) {
     if (!ctx_trycatch.HasCaught())
       shim_throw_error(&ctx, "Failed to initialize module");
   }
 
+  SHIM_STATE(&ctx)->init_nanos = uv_hrtime() - start;
+  SHIM_TRACE("SHIM INIT %llu ns, %llu functions lazy\n",
+    static_cast<unsigned long long>(SHIM_STATE(&ctx)->init_nanos),
+    static_cast<unsigned long long>(SHIM_STATE(&ctx)->lazy_pending));
+
   shim_context_cleanup(&ctx);
 }
 
 
+/* run the finalizers of instances that are still alive */
+void
+shim_class_finalize_all(shim_ctx_t* ctx, struct shim_class_s* klass)
+{
+  shim_handle_table_t* table = klass->instances;
+
+  for (size_t n = 0; n < table->nslabs; n++) {
+    for (size_t i = 0; i < SHIM_HANDLE_SLAB; i++) {
+      shim_handle_slot_t* slot = &table->slabs[n][i];
+      shim_val_t val;
+
+      if (!slot->used || slot->weak_cb == NULL)
+        continue;
+
+      shim_val_init(&val, Local<Value>(*slot->obj));
+      slot->weak_cb(&val, slot->data);
+    }
+  }
+}
+
+
+/**
+ * \param ctx Currently executing context
+ *
+ * Call this from the isolate's thread before disposing of an isolate the
+ * module was loaded into. Atoms, shapes, classes, cached functions and
+ * interned errors of the isolate are released, and the finalizers of class
+ * instances that are still alive are run. Nothing made by the shim in this
+ * isolate may be used afterwards.
+ */
+void
+shim_isolate_dispose(shim_ctx_t* ctx)
+{
+  shim_isolate_s* state = SHIM_STATE(ctx);
+
+  uv_mutex_lock(&states_lock);
+  for (shim_isolate_s** cur = &states; *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == state) {
+      *cur = state->next;
+      break;
+    }
+  }
+  uv_mutex_unlock(&states_lock);
+
+  if (current_state == state)
+    current_state = NULL;
+
+  while (state->classes != NULL) {
+    struct shim_class_s* klass = state->classes;
+    state->classes = klass->next;
+    shim_class_finalize_all(ctx, klass);
+    shim_handle_table_free(klass->instances);
+    klass->holder->func.Dispose();
+    klass->holder->tmpl.Dispose();
+    free(klass->holder->name);
+    delete klass->holder;
+    delete klass;
+  }
+
+  for (size_t i = 0; i < state->fcache_size; i++) {
+    while (state->fcache[i] != NULL) {
+      shim_fholder_s* holder = state->fcache[i];
+      state->fcache[i] = holder->next;
+      holder->func.Dispose();
+      free(holder->name);
+      delete holder;
+    }
+  }
+  free(state->fcache);
+
+  if (state->promises != NULL)
+    shim_handle_table_free(state->promises);
+
+  if (!state->promise_settle.IsEmpty())
+    state->promise_settle.Dispose();
+
+  while (!QUEUE_EMPTY(&state->work_free)) {
+    QUEUE* q = QUEUE_HEAD(&state->work_free);
+    QUEUE_REMOVE(q);
+    delete QUEUE_DATA(q, shim_work_t, queue);
+  }
+
+  while (state->shapes != NULL) {
+    shim_shape_s* shape = state->shapes;
+    state->shapes = shape->next;
+    shape->tmpl.Dispose();
+    shape->boilerplate.Dispose();
+    delete[] shape->atoms;
+    delete shape;
+  }
+
+  for (size_t i = 0; i < SHIM_ERRORS_SIZE; i++) {
+    while (state->errors[i] != NULL) {
+      shim_error_cache_s* cache = state->errors[i];
+      state->errors[i] = cache->next;
+      if (!cache->error.IsEmpty())
+        cache->error.Dispose();
+      delete cache;
+    }
+  }
+
+  while (state->atoms != NULL) {
+    shim_atom_s* atom = state->atoms;
+    state->atoms = atom->next;
+    atom->str.Dispose();
+    free(atom->name);
+    delete atom;
+  }
+
+  state->hidden_private.Dispose();
+  state->hidden_view.Dispose();
+  delete state;
+
+  ctx->state = NULL;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param loop The loop of the isolate's thread
+ *
+ * Jobs, pools and channels made in this isolate afterwards complete on
+ * \a loop instead of the default loop. Call it once, before queueing any
+ * work, from an isolate that doesn't run on node's main thread.
+ */
+void
+shim_isolate_set_loop(shim_ctx_t* ctx, uv_loop_t* loop)
+{
+  SHIM_STATE(ctx)->loop = loop;
+}
+
+
 /* TODO abstract out so we don't need multiple temporaries */
 
 /**
@@ -350,6 +1379,13 @@ shim_value_is(shim_val_t* val, shim_type_t type)
   if (val->type == type)
     return TRUE;
 
+  /* the undefined and null singletons have no handle to look at */
+  if (val->handle == NULL)
+    return FALSE;
+
+  if (val->flags & SHIM_VAL_EXACT)
+    return shim_val_exact_is(val, type);
+
   VAL_DEFINE(obj, val);
   shim_bool_t ret = FALSE;
 
@@ -398,6 +1434,27 @@ shim_value_is(shim_val_t* val, shim_type_t type)
     case SHIM_TYPE_BUFFER:
       ret = Buffer::HasInstance(obj);
       break;
+    case SHIM_TYPE_TYPEDARRAY:
+#if SHIM_NATIVE_TYPED_ARRAYS
+      ret = obj->IsTypedArray();
+#else
+      ret = obj->IsObject()
+        && obj.As<Object>()->HasIndexedPropertiesInExternalArrayData()
+        && !Buffer::HasInstance(obj)
+        && !obj.As<Object>()->GetConstructorName()->Equals(
+          String::NewSymbol("ArrayBuffer"));
+#endif
+      break;
+    case SHIM_TYPE_ARRAYBUFFER:
+#if SHIM_NATIVE_TYPED_ARRAYS
+      ret = obj->IsArrayBuffer();
+#else
+      ret = obj->IsObject()
+        && obj.As<Object>()->HasIndexedPropertiesInExternalArrayData()
+        && obj.As<Object>()->GetConstructorName()->Equals(
+          String::NewSymbol("ArrayBuffer"));
+#endif
+      break;
     case SHIM_TYPE_UNKNOWN:
     default:
       ret = FALSE;
@@ -452,9 +1509,13 @@ shim_value_to(shim_ctx_t* ctx, shim_val_t* val, shim_type_t type,
   if (val->type == type) {
     rval->type = type;
     rval->handle = val->handle;
+    rval->flags = (rval->flags & ~SHIM_VAL_EXACT)
+      | (val->flags & SHIM_VAL_EXACT);
+    rval->num = val->num;
     return TRUE;
   }
 
+  rval->flags &= ~SHIM_VAL_EXACT;
   VAL_DEFINE(obj, val);
 
   switch (type) {
@@ -517,22 +1578,82 @@ shim_null()
   return &shim__null;
 }
 
+/**
+ * \param ctx The currently executing context
+ * \return An undefined value, owned by the context inside a boundary call
+ *
+ * ::shim_val_t is opaque, so this is how C callers get storage for an rval
+ * or for shim_unpack() of a string
+ */
+shim_val_t*
+shim_value_new(shim_ctx_t* ctx)
+{
+  return shim_val_alloc(ctx, Undefined());
+}
+
 /**
  * \param val The given value
  * \sa [memory](md_docs_memory.html)
  *
  * Presuming the value was not allocated for ::shim_args_t or being used for
  * shim_args_set_rval() use this method to free the allocated memory
+ *
+ * Values created inside a boundary call come from the context's arena and are
+ * reclaimed all at once when the call returns, releasing them is a no-op
  */
 void
 shim_value_release(shim_val_t* val)
 {
-  if (val != NULL && val->type != SHIM_TYPE_NULL
-      && val->type != SHIM_TYPE_UNDEFINED)
+  if (val != NULL && (val->flags & SHIM_VAL_OWNER) == SHIM_VAL_HEAP)
     free(val);
 }
 
 
+/**
+ * \param ctx The currently executing context
+ * \param name The property name to intern
+ * \return The atom representing the name
+ *
+ * Atoms are internalized once and stay valid for the lifetime of the isolate,
+ * asking for the same name again returns the same atom. Use them with the
+ * `_atom` variants of the object and function methods in hot paths.
+ */
+shim_atom_t*
+shim_atom_new(shim_ctx_t* ctx, const char* name)
+{
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  shim_isolate_s* state = SHIM_STATE(ctx);
+  shim_atom_s* atom;
+
+  for (atom = state->atoms; atom != NULL; atom = atom->next)
+    if (strcmp(atom->name, name) == 0)
+      return atom;
+
+  atom = new shim_atom_s;
+  atom->name = strdup(name);
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  atom->str = Persistent<String>::New(isolate, String::NewSymbol(name));
+#else
+  atom->str = Persistent<String>::New(String::NewSymbol(name));
+#endif
+  atom->next = state->atoms;
+  state->atoms = atom;
+
+  return atom;
+}
+
+
+/**
+ * \param atom The given atom
+ * \return The name the atom was created with
+ */
+const char*
+shim_atom_name(shim_atom_t* atom)
+{
+  return atom->name;
+}
+
+
 /**
  * \param ctx The currently executing context
  * \param klass The constructor to be used (may be NULL)
@@ -557,24 +1678,88 @@ shim_obj_new(shim_ctx_t* ctx, shim_val_t* klass, shim_val_t* proto)
 
 /**
  * \param ctx The currently executing context
- * \param klass The given constructor
- * \param argc The amount of arguments being passed
- * \param argv The array of arguments to be passed
- * \return The returned object
+ * \param names The property names objects of this shape will have
+ * \param n The number of entries in \a names
+ * \return The shape, valid for the lifetime of the isolate
  *
- * Use this to instantiate an object with the given arguments
+ * Objects made from the same shape share one hidden class, so creating them
+ * and later accessing them from JavaScript stays on the fast path
+ * \sa shim_obj_new_from_shape()
  */
-shim_val_t*
-shim_obj_new_instance(shim_ctx_t* ctx, shim_val_t* klass, size_t argc,
-  shim_val_t** argv)
+shim_shape_t*
+shim_shape_new(shim_ctx_t* ctx, const char** names, size_t n)
 {
-  return NULL;
-}
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  shim_shape_s* shape = new shim_shape_s;
+  shape->n = n;
+  shape->atoms = new shim_atom_t*[n];
 
-/**
- * \param ctx The currently executing context
- * \param src The given value
- * \return The new Local value representing the previous value
+  Local<ObjectTemplate> tmpl = ObjectTemplate::New();
+
+  for (size_t i = 0; i < n; i++) {
+    shape->atoms[i] = shim::shim_atom_new(ctx, names[i]);
+    tmpl->Set(ATOM_TO_STR(shape->atoms[i]), Undefined());
+  }
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  shape->tmpl = Persistent<ObjectTemplate>::New(isolate, tmpl);
+  shape->boilerplate = Persistent<Object>::New(isolate, tmpl->NewInstance());
+#else
+  shape->tmpl = Persistent<ObjectTemplate>::New(tmpl);
+  shape->boilerplate = Persistent<Object>::New(tmpl->NewInstance());
+#endif
+
+  shape->next = SHIM_STATE(ctx)->shapes;
+  SHIM_STATE(ctx)->shapes = shape;
+
+  return shape;
+}
+
+
+/**
+ * \param ctx The currently executing context
+ * \param shape The shape of the object
+ * \param values The values of each property, in the order of the shape
+ * \return The created object
+ *
+ * \a values may be NULL to create an object whose properties are all
+ * `undefined`
+ */
+shim_val_t*
+shim_obj_new_from_shape(shim_ctx_t* ctx, shim_shape_t* shape,
+  shim_val_t** values)
+{
+  Local<Object> obj = shape->boilerplate->Clone();
+
+  if (values != NULL) {
+    for (size_t i = 0; i < shape->n; i++)
+      obj->Set(ATOM_TO_STR(shape->atoms[i]), shim_val_handle(values[i]));
+  }
+
+  return shim_val_alloc(ctx, obj, SHIM_TYPE_OBJECT);
+}
+
+
+/**
+ * \param ctx The currently executing context
+ * \param klass The given constructor
+ * \param argc The amount of arguments being passed
+ * \param argv The array of arguments to be passed
+ * \return The returned object
+ *
+ * Use this to instantiate an object with the given arguments
+ */
+shim_val_t*
+shim_obj_new_instance(shim_ctx_t* ctx, shim_val_t* klass, size_t argc,
+  shim_val_t** argv)
+{
+  return NULL;
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param src The given value
+ * \return The new Local value representing the previous value
  *
  * Use this when you might want to create a Local of a persistent
  * \sa persistents
@@ -633,6 +1818,19 @@ shim_obj_has_sym(shim_ctx_t* ctx, shim_val_t* val, shim_val_t* sym)
   return obj->Has(OBJ_TO_STRING(SHIM_TO_VAL(sym)));
 }
 
+/**
+ * \param ctx The currently executing context
+ * \param val The given object
+ * \param atom The atom naming the property
+ * \return TRUE if the object has the property, otherwise FALSE
+ */
+shim_bool_t
+shim_obj_has_atom(shim_ctx_t* ctx, shim_val_t* val, shim_atom_t* atom)
+{
+  Local<Object> obj = OBJ_TO_OBJECT(SHIM_TO_VAL(val));
+  return obj->Has(ATOM_TO_STR(atom)) ? TRUE : FALSE;
+}
+
 /**
  * \param ctx The currently executing context
  * \param obj The given object
@@ -680,6 +1878,54 @@ shim_obj_set_prop_sym(shim_ctx_t* ctx, shim_val_t* obj, shim_val_t* sym,
   return jsobj->Set(SHIM_TO_VAL(sym), SHIM_TO_VAL(val));
 }
 
+/**
+ * \param ctx The currently executing context
+ * \param obj The given object
+ * \param atom The atom naming the property
+ * \param val The value to be stored
+ * \return TRUE if the property was set, otherwise FALSE
+ */
+shim_bool_t
+shim_obj_set_prop_atom(shim_ctx_t* ctx, shim_val_t* obj, shim_atom_t* atom,
+  shim_val_t* val)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+  return jsobj->Set(ATOM_TO_STR(atom), SHIM_TO_VAL(val));
+}
+
+void
+shim_class_weak_cb(shim_val_t* val, void* data)
+{
+  struct shim_class_s* klass = static_cast<struct shim_class_s*>(data);
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(val));
+  void* ptr = SHIM_GET_FIELD(jsobj, SHIM_CLASS_FIELD_DATA);
+  size_t size = SHIM_FIELD_TO_SIZE(SHIM_GET_FIELD(jsobj,
+    SHIM_CLASS_FIELD_SIZE));
+
+  if (size > 0)
+    shim_external_adjust(Isolate::GetCurrent(), -static_cast<int64_t>(size));
+
+  if (ptr != NULL && klass->finalize_cb != NULL)
+    klass->finalize_cb(ptr, klass->hint);
+}
+
+
+/* Register an instance with its class to be told when it is collected */
+void
+shim_class_track(shim_ctx_t* ctx, struct shim_class_s* klass, shim_val_t* obj)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+
+  if (SHIM_GET_FIELD(jsobj, SHIM_CLASS_FIELD_HANDLE) != NULL)
+    return;
+
+  shim_handle_t id = shim_handle_table_add(ctx, klass->instances, obj);
+  shim_handle_table_make_weak(klass->instances, id, klass,
+    shim_class_weak_cb);
+  SHIM_SET_FIELD(jsobj, SHIM_CLASS_FIELD_HANDLE, SHIM_FIELD_FROM_SIZE(id));
+}
+
+
 /**
  * \param ctx The currently executing context
  * \param obj The given object
@@ -689,13 +1935,29 @@ shim_obj_set_prop_sym(shim_ctx_t* ctx, shim_val_t* obj, shim_val_t* sym,
  * Use this to associate C memory with a given object, which can be recalled
  * at a later time with shim_obj_get_private()
  *
+ * Instances of a class made by shim_class_new() keep the pointer in an
+ * internal field, and the class finalizer is called with it once the
+ * instance is collected.
+ *
  * \sa shim_obj_make_weak()
  */
 shim_bool_t
 shim_obj_set_private(shim_ctx_t* ctx, shim_val_t* obj, void* data)
 {
   Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
-  return jsobj->SetHiddenValue(hidden_private, External::New(data));
+  struct shim_class_s* klass = shim_class_of(SHIM_STATE(ctx), jsobj);
+
+  if (klass == NULL)
+    return jsobj->SetHiddenValue(SHIM_STATE(ctx)->hidden_private,
+      External::New(data));
+
+  SHIM_SET_FIELD(jsobj, SHIM_CLASS_FIELD_DATA, data);
+
+  /* the first pointer stored registers the instance for finalization */
+  if (klass->finalize_cb != NULL && data != NULL)
+    shim_class_track(ctx, klass, obj);
+
+  return TRUE;
 }
 
 /**
@@ -724,6 +1986,38 @@ shim_obj_set_funcs(shim_ctx_t* ctx, shim_val_t* recv,
   return TRUE;
 }
 
+/**
+ * \param ctx The currently executing context
+ * \param recv The object to add the functions to
+ * \param funcs The null terminated array of functions, which must stay valid
+ * for the lifetime of the isolate
+ * \return TRUE if all functions were able to be added, otherwise FALSE
+ *
+ * Like shim_obj_set_funcs(), but each function is only made the first time
+ * its property is read. Large bindings that use few of their functions per
+ * process start faster this way.
+ */
+shim_bool_t
+shim_obj_set_funcs_lazy(shim_ctx_t* ctx, shim_val_t* recv,
+  const shim_fspec_t* funcs)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(recv));
+  shim_isolate_s* state = SHIM_STATE(ctx);
+
+  for (size_t i = 0; funcs[i].name != NULL; i++) {
+    Local<External> spec = External::New(
+      const_cast<shim_fspec_t*>(&funcs[i]));
+
+    if (!jsobj->SetAccessor(String::NewSymbol(funcs[i].name), shim_lazy_get,
+        shim_lazy_set, spec))
+      return FALSE;
+
+    state->lazy_pending++;
+  }
+
+  return TRUE;
+}
+
 /**
  * \param ctx The currently executing context
  * \param obj The the given object
@@ -737,8 +2031,7 @@ shim_obj_get_prop_name(shim_ctx_t* ctx, shim_val_t* obj, const char* name,
 {
   Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
   Local<Value> val = jsobj->Get(String::NewSymbol(name));
-  rval->handle = *val;
-  rval->type = SHIM_TYPE_UNKNOWN;
+  SHIM_VAL_SET(rval, *val);
   return TRUE;
 }
 
@@ -756,8 +2049,7 @@ shim_obj_get_prop_id(shim_ctx_t* ctx, shim_val_t* obj, uint32_t idx,
 {
   Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
   Local<Value> val = jsobj->Get(idx);
-  rval->handle = *val;
-  rval->type = SHIM_TYPE_UNKNOWN;
+  SHIM_VAL_SET(rval, *val);
   return TRUE;
 }
 
@@ -775,8 +2067,25 @@ shim_obj_get_prop_sym(shim_ctx_t* ctx, shim_val_t* obj, shim_val_t* sym,
 {
   Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
   Local<Value> val = jsobj->Get(SHIM_TO_VAL(sym));
-  rval->handle = *val;
-  rval->type = SHIM_TYPE_UNKNOWN;
+  SHIM_VAL_SET(rval, *val);
+  return TRUE;
+}
+
+
+/**
+ * \param ctx The currently executing context
+ * \param obj The the given object
+ * \param atom The atom naming the property
+ * \param rval The actual value returned
+ * \return TRUE if object had the propert, otherwise FALSE
+ */
+shim_bool_t
+shim_obj_get_prop_atom(shim_ctx_t* ctx, shim_val_t* obj, shim_atom_t* atom,
+  shim_val_t* rval)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+  Local<Value> val = jsobj->Get(ATOM_TO_STR(atom));
+  SHIM_VAL_SET(rval, *val);
   return TRUE;
 }
 
@@ -791,11 +2100,121 @@ shim_bool_t
 shim_obj_get_private(shim_ctx_t* ctx, shim_val_t* obj, void** data)
 {
   Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
-  Local<Value> ext = jsobj->GetHiddenValue(hidden_private);
+
+  if (shim_class_of(SHIM_STATE(ctx), jsobj) != NULL) {
+    *data = SHIM_GET_FIELD(jsobj, SHIM_CLASS_FIELD_DATA);
+    return TRUE;
+  }
+
+  Local<Value> ext = jsobj->GetHiddenValue(SHIM_STATE(ctx)->hidden_private);
   *data = ext.As<External>()->Value();
   return TRUE;
 }
 
+/**
+ * \param ctx The currently executing context
+ * \param obj The given object
+ * \param fields The table describing each property and its struct member
+ * \param n The number of entries in \a fields
+ * \param out The struct to unpack into
+ * \return TRUE if every property was unpacked, otherwise FALSE
+ *
+ * Each property is converted as shim_unpack_type() would, if one can't be
+ * converted FALSE is returned and an exception is set. Members unpacked
+ * before the failure are left filled in.
+ */
+shim_bool_t
+shim_obj_get_props(shim_ctx_t* ctx, shim_val_t* obj,
+  const shim_field_t* fields, size_t n, void* out)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+  char* base = static_cast<char*>(out);
+  shim_val_t tmp;
+
+  for (size_t i = 0; i < n; i++) {
+    const shim_field_t* field = &fields[i];
+    shim_atom_t* atom = *field->atom;
+
+    shim_val_init(&tmp, jsobj->Get(ATOM_TO_STR(atom)));
+
+    if (!shim_unpack_type(ctx, &tmp, field->type, base + field->offset)) {
+      shim_throw_type_error(ctx, "Property %s not of type %s",
+        atom->name, shim_type_str(field->type));
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param obj The given object
+ * \param fields The table describing each property and its struct member
+ * \param n The number of entries in \a fields
+ * \param in The struct to pack from
+ * \return TRUE if every property was set, otherwise FALSE
+ *
+ * Numeric, boolean and external members are stored as their C type, any
+ * other type expects the member to be a `shim_val_t*`.
+ */
+shim_bool_t
+shim_obj_set_props(shim_ctx_t* ctx, shim_val_t* obj,
+  const shim_field_t* fields, size_t n, const void* in)
+{
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+  const char* base = static_cast<const char*>(in);
+
+  for (size_t i = 0; i < n; i++) {
+    const shim_field_t* field = &fields[i];
+    const void* member = base + field->offset;
+    Local<Value> val;
+
+    switch(field->type) {
+      case SHIM_TYPE_UNDEFINED:
+        val = *Undefined();
+        break;
+      case SHIM_TYPE_NULL:
+        val = *Null();
+        break;
+      case SHIM_TYPE_BOOL:
+        val = *Boolean::New(*static_cast<const shim_bool_t*>(member));
+        break;
+      case SHIM_TYPE_INTEGER:
+        val = Number::New(*static_cast<const int64_t*>(member));
+        break;
+      case SHIM_TYPE_INT32:
+        val = Integer::New(*static_cast<const int32_t*>(member));
+        break;
+      case SHIM_TYPE_UINT32:
+        val = Integer::NewFromUnsigned(*static_cast<const uint32_t*>(member));
+        break;
+      case SHIM_TYPE_NUMBER:
+        val = Number::New(*static_cast<const double*>(member));
+        break;
+      case SHIM_TYPE_EXTERNAL:
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+        val = External::New(*static_cast<void* const*>(member));
+#else
+        val = External::Wrap(*static_cast<void* const*>(member));
+#endif
+        break;
+      case SHIM_TYPE_UNKNOWN:
+        shim_throw_type_error(ctx, "Property %s has no type",
+          (*field->atom)->name);
+        return FALSE;
+      default:
+        val = shim_val_handle(*static_cast<shim_val_t* const*>(member));
+        break;
+    }
+
+    if (!jsobj->Set(ATOM_TO_STR(*field->atom), val))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /**
  * \param ctx The currently executing context
  * \param val The the given object
@@ -810,8 +2229,8 @@ shim_persistent_new(shim_ctx_t* ctx, shim_val_t* val)
     static_cast<Isolate*>(ctx->isolate),
 #endif
     obj);
-  /* TODO flag a val as persistent */
-  return shim_val_alloc(ctx, pobj);
+  /* persistents outlive the context, so never come from the arena */
+  return shim_val_alloc_heap(pobj);
 }
 
 /**
@@ -822,7 +2241,99 @@ shim_persistent_dispose(shim_val_t* val)
 {
   Persistent<Value> tmp(SHIM_TO_VAL(val));
   tmp.Dispose();
-  free(val);
+  shim_value_release(val);
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param val The given persistent
+ * \return A local handle to the same value
+ *
+ * The local stays valid for the current scope, even if the persistent is
+ * disposed in the meantime
+ */
+shim_val_t*
+shim_persistent_local(shim_ctx_t* ctx, shim_val_t* val)
+{
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return shim_val_alloc(ctx, Local<Value>::New(
+    static_cast<Isolate*>(ctx->isolate), SHIM_TO_VAL(val)));
+#else
+  return shim_val_alloc(ctx, Local<Value>::New(SHIM_TO_VAL(val)));
+#endif
+}
+
+/**
+ * \param ctx The currently executing context
+ * \return The opened scope
+ *
+ * Handles created from now on, and the wrappers of them, belong to this scope
+ * and go away with it. Open one around the body of a long loop to keep its
+ * memory bounded. Scopes must be closed in the reverse order they were opened.
+ *
+ * \sa shim_scope_close() shim_scope_close_escape()
+ */
+shim_scope_t*
+shim_scope_open(shim_ctx_t* ctx)
+{
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+  shim_scope_t* scope = new shim_scope_t(static_cast<Isolate*>(ctx->isolate));
+#else
+  shim_scope_t* scope = new shim_scope_t;
+#endif
+  shim_arena_t* arena = static_cast<shim_arena_t*>(ctx->allocs);
+
+  scope->chunk = arena != NULL ? arena->cur : NULL;
+  scope->used = arena != NULL ? arena->cur->used : 0;
+  return scope;
+}
+
+
+void
+shim_scope_rewind(shim_ctx_t* ctx, shim_scope_t* scope)
+{
+  shim_arena_t* arena = static_cast<shim_arena_t*>(ctx->allocs);
+
+  if (arena != NULL && scope->chunk != NULL)
+    shim_arena_rewind(arena, scope->chunk, scope->used);
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param scope The scope to close
+ *
+ * Every value created in the scope, and its wrapper, is no longer valid
+ */
+void
+shim_scope_close(shim_ctx_t* ctx, shim_scope_t* scope)
+{
+  shim_scope_rewind(ctx, scope);
+  delete scope;
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param scope The scope to close
+ * \param val The value to keep
+ * \return A wrapper for \a val that belongs to the enclosing scope
+ *
+ * Like shim_scope_close(), except for the one value that is kept
+ */
+shim_val_t*
+shim_scope_close_escape(shim_ctx_t* ctx, shim_scope_t* scope,
+  shim_val_t* val)
+{
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+  Local<Value> kept = scope->scope.Escape(shim_val_handle(val));
+#else
+  Local<Value> kept = scope->scope.Close(shim_val_handle(val));
+#endif
+  shim_type_t type = val->type;
+
+  shim_scope_rewind(ctx, scope);
+  delete scope;
+
+  return shim_val_alloc(ctx, kept, type);
 }
 
 
@@ -837,8 +2348,9 @@ common_weak_cb(Persistent<Value> obj, void* data)
   weak_baton_t* baton = static_cast<weak_baton_t*>(data);
 #endif
   SHIM_PROLOGUE(ctx);
-  shim_val_t* tmp = shim_val_alloc(NULL, obj);
+  shim_val_t* tmp = shim_val_alloc_heap(obj);
   baton->weak_cb(tmp, baton->data);
+  shim_context_cleanup(&ctx);
   delete baton;
 }
 
@@ -873,50 +2385,445 @@ shim_obj_clear_weak(shim_val_t* val)
   tmp.ClearWeak();
 }
 
-/**
- * \param ctx Currently executing context
- * \param cfunc The function pointer to be executed
- * \param argc The number of arguments the function takes
- * \param flags The flags for the function
- * \param name The name of the function
- * \param hint Arbitrary data to keep associated with the function
- * \return The wrapped function
- */
-shim_val_t*
-shim_func_new(shim_ctx_t* ctx, shim_func cfunc, size_t argc, int32_t flags,
-  const char* name, void* hint)
+/* NULL when the id was never handed out or its handle is gone */
+shim_handle_slot_t*
+shim_handle_slot(shim_handle_table_t* table, shim_handle_t id)
 {
-  shim_fholder_s* holder = new shim_fholder_s;
-  holder->cfunc = cfunc;
-  holder->data = hint;
+  uint32_t index = static_cast<uint32_t>(id);
+  uint32_t gen = static_cast<uint32_t>(id >> 32);
 
-  Local<External> ext = External::New(reinterpret_cast<void*>(holder));
+  if (index == 0)
+    return NULL;
 
-  Local<FunctionTemplate> ft = FunctionTemplate::New(shim::Static, ext);
-  Local<Function> fh = ft->GetFunction();
-  fh->SetName(String::NewSymbol(name));
-  return shim_val_alloc(ctx, fh);
+  size_t idx = index - 1;
+  if (idx / SHIM_HANDLE_SLAB >= table->nslabs)
+    return NULL;
+
+  shim_handle_slot_t* slot =
+    &table->slabs[idx / SHIM_HANDLE_SLAB][idx % SHIM_HANDLE_SLAB];
+  if (!slot->used || slot->gen != gen)
+    return NULL;
+
+  return slot;
 }
 
-/**
- * \param ctx Currently executing context
- * \param self The this parameter of the function call
- * \param sym The symbol representing the name of the function
- * \param argc The number of args to pass the function
- * \param argv The array of arguments to pass to the function
- * \param rval The return value of the function
- * \return TRUE if the function succeeded, otherwise FALSE
- */
-shim_bool_t
-shim_func_call_sym(shim_ctx_t* ctx, shim_val_t* self, shim_val_t* sym,
-  size_t argc, shim_val_t** argv, shim_val_t* rval)
+
+void
+shim_handle_slot_release(shim_handle_slot_t* slot)
+{
+  shim_handle_table_t* table = slot->table;
+
+  slot->obj.Dispose();
+  slot->obj.Clear();
+  slot->used = FALSE;
+  slot->gen++;
+  slot->weak_cb = NULL;
+  slot->data = NULL;
+  slot->next_free = table->free_head;
+  table->free_head = slot->index;
+  table->live--;
+}
+
+
+void
+shim_handle_table_grow(shim_handle_table_t* table)
+{
+  size_t n = table->nslabs;
+  table->slabs = static_cast<shim_handle_slot_t**>(
+    realloc(table->slabs, (n + 1) * sizeof(shim_handle_slot_t*)));
+
+  shim_handle_slot_t* slab = new shim_handle_slot_t[SHIM_HANDLE_SLAB];
+  table->slabs[n] = slab;
+  table->nslabs = n + 1;
+
+  /* thread the new slots onto the free list in index order */
+  uint32_t base = n * SHIM_HANDLE_SLAB + 1;
+  for (uint32_t i = 0; i < SHIM_HANDLE_SLAB; i++) {
+    slab[i].table = table;
+    slab[i].index = base + i;
+    slab[i].gen = 0;
+    slab[i].used = FALSE;
+    slab[i].weak_cb = NULL;
+    slab[i].data = NULL;
+    slab[i].next_free = i + 1 < SHIM_HANDLE_SLAB ? base + i + 1
+      : table->free_head;
+  }
+
+  table->free_head = base;
+}
+
+
+void
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+handle_weak_cb(Isolate* iso, Persistent<Value>* pobj,
+  shim_handle_slot_t* slot)
+{
+  Persistent<Value> obj = *pobj;
+#else
+handle_weak_cb(Persistent<Value> obj, void* data)
+{
+  shim_handle_slot_t* slot = static_cast<shim_handle_slot_t*>(data);
+#endif
+  SHIM_PROLOGUE(ctx);
+  shim_val_t* tmp = shim_val_alloc(&ctx, obj);
+  uint32_t gen = slot->gen;
+  slot->weak_cb(tmp, slot->data);
+  shim_context_cleanup(&ctx);
+
+  /* the callback may already have removed it, and even reused the slot */
+  if (slot->used && slot->gen == gen)
+    shim_handle_slot_release(slot);
+}
+
+/**
+ * \return A new empty table
+ *
+ * Tables hand out integer ids instead of heap wrappers, slots are carved
+ * from slabs of SHIM_HANDLE_SLAB so holding many objects costs no allocation
+ * per object. Slots are reused once removed, but under a new generation, so
+ * a stale id is rejected rather than aliasing the new handle.
+ */
+shim_handle_table_t*
+shim_handle_table_new()
+{
+  shim_handle_table_t* table = new shim_handle_table_t;
+  table->slabs = NULL;
+  table->nslabs = 0;
+  table->free_head = 0;
+  table->live = 0;
+  return table;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param table The table to add to
+ * \param val The value to make persistent
+ * \return The id of the new handle
+ */
+shim_handle_t
+shim_handle_table_add(shim_ctx_t* ctx, shim_handle_table_t* table,
+  shim_val_t* val)
+{
+  if (table->free_head == 0)
+    shim_handle_table_grow(table);
+
+  size_t idx = table->free_head - 1;
+  shim_handle_slot_t* slot =
+    &table->slabs[idx / SHIM_HANDLE_SLAB][idx % SHIM_HANDLE_SLAB];
+  table->free_head = slot->next_free;
+
+  slot->obj = Persistent<Value>::New(
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+    static_cast<Isolate*>(ctx->isolate),
+#endif
+    shim_val_handle(val));
+  slot->used = TRUE;
+  table->live++;
+
+  return SHIM_HANDLE_ID(slot);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param table The table holding the handle
+ * \param id The handle
+ * \return The value, owned by the context, or NULL if the handle is gone
+ */
+shim_val_t*
+shim_handle_table_get(shim_ctx_t* ctx, shim_handle_table_t* table,
+  shim_handle_t id)
+{
+  shim_handle_slot_t* slot = shim_handle_slot(table, id);
+  if (slot == NULL)
+    return NULL;
+  return shim_val_alloc(ctx, Local<Value>(*slot->obj));
+}
+
+/**
+ * \param table The table holding the handle
+ * \param id The handle to dispose, nothing happens if it is already gone
+ */
+void
+shim_handle_table_remove(shim_handle_table_t* table, shim_handle_t id)
+{
+  shim_handle_slot_t* slot = shim_handle_slot(table, id);
+  if (slot != NULL)
+    shim_handle_slot_release(slot);
+}
+
+/**
+ * \param table The table holding the handle
+ * \param id The handle to make weak
+ * \param data Arbitrary data to pass to the weak_cb
+ * \param weak_cb Callback that will be called when the object is about to be
+ * freed, the handle is removed once it returns
+ */
+void
+shim_handle_table_make_weak(shim_handle_table_t* table, shim_handle_t id,
+  void* data, shim_weak_cb weak_cb)
+{
+  shim_handle_slot_t* slot = shim_handle_slot(table, id);
+  if (slot == NULL)
+    return;
+  slot->weak_cb = weak_cb;
+  slot->data = data;
+  slot->obj.MakeWeak(slot, handle_weak_cb);
+}
+
+/**
+ * \param table The table holding the handle
+ * \param id The handle to make strong
+ */
+void
+shim_handle_table_clear_weak(shim_handle_table_t* table, shim_handle_t id)
+{
+  shim_handle_slot_t* slot = shim_handle_slot(table, id);
+  if (slot == NULL)
+    return;
+  slot->obj.ClearWeak();
+  slot->weak_cb = NULL;
+  slot->data = NULL;
+}
+
+/**
+ * \param table The given table
+ * \param live Set to the number of handles in use, may be NULL
+ * \param bytes Set to the memory the table holds on to, may be NULL
+ */
+void
+shim_handle_table_stats(shim_handle_table_t* table, size_t* live,
+  size_t* bytes)
+{
+  if (live != NULL)
+    *live = table->live;
+
+  if (bytes != NULL)
+    *bytes = sizeof(shim_handle_table_t)
+      + table->nslabs * sizeof(shim_handle_slot_t*)
+      + table->nslabs * SHIM_HANDLE_SLAB * sizeof(shim_handle_slot_t);
+}
+
+/**
+ * \param table The table to empty
+ *
+ * Weak callbacks are not called, the slabs are kept for reuse
+ */
+void
+shim_persistent_dispose_all(shim_handle_table_t* table)
+{
+  table->free_head = 0;
+
+  /* walk backwards so the free list comes out in index order */
+  for (size_t n = table->nslabs; n > 0; n--) {
+    shim_handle_slot_t* slab = table->slabs[n - 1];
+
+    for (size_t i = SHIM_HANDLE_SLAB; i > 0; i--) {
+      shim_handle_slot_t* slot = &slab[i - 1];
+
+      if (slot->used) {
+        slot->obj.Dispose();
+        slot->obj.Clear();
+        slot->used = FALSE;
+        slot->gen++;
+        slot->weak_cb = NULL;
+        slot->data = NULL;
+      }
+
+      slot->next_free = table->free_head;
+      table->free_head = slot->index;
+    }
+  }
+
+  table->live = 0;
+}
+
+/**
+ * \param table The table to free
+ */
+void
+shim_handle_table_free(shim_handle_table_t* table)
+{
+  shim::shim_persistent_dispose_all(table);
+
+  for (size_t n = 0; n < table->nslabs; n++)
+    delete[] table->slabs[n];
+
+  free(table->slabs);
+  delete table;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param cfunc The function pointer to be executed
+ * \param argc The number of arguments the function takes
+ * \param flags The flags for the function
+ * \param name The name of the function
+ * \param hint Arbitrary data to keep associated with the function
+ * \return The wrapped function
+ *
+ * While the function is alive, asking again for the same \a cfunc, \a hint,
+ * \a flags and \a name yields the same function object. Nothing else holds
+ * on to it, so closures made with a distinct \a hint are collected like any
+ * other function and their holder is freed with them. Before node v0.11.13
+ * V8 can only instantiate functions from templates, and keeps every such
+ * function for the lifetime of the context.
+ */
+shim_val_t*
+shim_func_new(shim_ctx_t* ctx, shim_func cfunc, size_t argc, int32_t flags,
+  const char* name, void* hint)
+{
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  shim_isolate_s* state = SHIM_STATE(ctx);
+  shim_fholder_s* holder = shim_fcache_find(state, cfunc, hint, flags, name);
+
+  /* the weak callback drops collected functions, so a hit is still alive */
+  if (holder != NULL)
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+    return shim_val_alloc(ctx, Local<Value>::New(isolate, holder->func),
+      SHIM_TYPE_FUNCTION);
+#else
+    return shim_val_alloc(ctx, Local<Value>::New(holder->func),
+      SHIM_TYPE_FUNCTION);
+#endif
+
+  holder = new shim_fholder_s;
+  holder->cfunc = cfunc;
+  holder->data = hint;
+  holder->flags = flags;
+  holder->name = name != NULL ? strdup(name) : NULL;
+  holder->state = state;
+  holder->klass = NULL;
+  holder->calls = 0;
+  holder->nanos = 0;
+  holder->throws = 0;
+
+  Local<External> ext = External::New(reinterpret_cast<void*>(holder));
+
+  /*
+   * a function instantiated from a template is cached by the context for as
+   * long as the context lives, Function::New() makes one that isn't
+   */
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+  Local<Function> fh = Function::New(isolate, shim::Static, ext);
+#else
+  Local<FunctionTemplate> ft = FunctionTemplate::New(shim::Static, ext);
+  if (name != NULL)
+    ft->SetClassName(String::NewSymbol(name));
+
+  Local<Function> fh = ft->GetFunction();
+#endif
+  if (name != NULL)
+    fh->SetName(String::NewSymbol(name));
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  holder->func = Persistent<Value>::New(isolate, fh);
+  holder->func.MakeWeak(holder, shim_fholder_weak_cb);
+#else
+  holder->func = Persistent<Value>::New(fh);
+  holder->func.MakeWeak(holder, shim_fholder_weak_cb);
+#endif
+
+  shim_fcache_insert(state, holder);
+
+  return shim_val_alloc(ctx, fh, SHIM_TYPE_FUNCTION);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param name The name of the class
+ * \param ctor The function run for `new`, `this` is the new instance
+ * \param argc The number of arguments the constructor takes
+ * \param methods Functions to put on the prototype, may be NULL
+ * \param finalize_cb Called with an instance's private data once it is
+ * collected, may be NULL
+ * \param hint Arbitrary data passed to \a ctor and \a finalize_cb
+ * \return The constructor, valid for the lifetime of the isolate
+ *
+ * Instances have internal fields, so shim_obj_set_private() and
+ * shim_obj_get_private() are a field write and read instead of a hidden
+ * property lookup, and setting the private data registers the instance
+ * for finalization without a separate shim_obj_make_weak()
+ */
+shim_val_t*
+shim_class_new(shim_ctx_t* ctx, const char* name, shim_func ctor, size_t argc,
+  const shim_fspec_t* methods, shim_finalize_cb finalize_cb, void* hint)
+{
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+
+  struct shim_class_s* klass = new struct shim_class_s;
+  klass->finalize_cb = finalize_cb;
+  klass->hint = hint;
+  klass->instances = shim::shim_handle_table_new();
+
+  shim_fholder_s* holder = new shim_fholder_s;
+  holder->cfunc = ctor;
+  holder->data = hint;
+  holder->flags = 0;
+  holder->name = name != NULL ? strdup(name) : NULL;
+  holder->state = SHIM_STATE(ctx);
+  holder->klass = klass;
+  holder->calls = 0;
+  holder->nanos = 0;
+  holder->throws = 0;
+  holder->next = NULL;
+  klass->holder = holder;
+
+  Local<External> ext = External::New(reinterpret_cast<void*>(holder));
+  Local<FunctionTemplate> ft = FunctionTemplate::New(shim::Static, ext);
+  ft->InstanceTemplate()->SetInternalFieldCount(SHIM_CLASS_FIELDS);
+  if (name != NULL)
+    ft->SetClassName(String::NewSymbol(name));
+
+  Local<Function> fh = ft->GetFunction();
+
+  /* nothing else has seen the class yet, so a failure can free it all */
+  if (methods != NULL) {
+    shim_val_t proto;
+    shim_val_init(&proto, fh->Get(String::NewSymbol("prototype")),
+      SHIM_TYPE_OBJECT);
+    if (!shim::shim_obj_set_funcs(ctx, &proto, methods)) {
+      shim_handle_table_free(klass->instances);
+      free(holder->name);
+      delete holder;
+      delete klass;
+      return NULL;
+    }
+  }
+
+  /* classes live as long as the isolate, so their holder is never weak */
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  holder->tmpl = Persistent<FunctionTemplate>::New(isolate, ft);
+  holder->func = Persistent<Value>::New(isolate, fh);
+#else
+  holder->tmpl = Persistent<FunctionTemplate>::New(ft);
+  holder->func = Persistent<Value>::New(fh);
+#endif
+
+  klass->next = SHIM_STATE(ctx)->classes;
+  SHIM_STATE(ctx)->classes = klass;
+
+  return shim_val_alloc(ctx, fh, SHIM_TYPE_FUNCTION);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param self The this parameter of the function call
+ * \param sym The symbol representing the name of the function
+ * \param argc The number of args to pass the function
+ * \param argv The array of arguments to pass to the function
+ * \param rval The return value of the function
+ * \return TRUE if the function succeeded, otherwise FALSE
+ */
+shim_bool_t
+shim_func_call_sym(shim_ctx_t* ctx, shim_val_t* self, shim_val_t* sym,
+  size_t argc, shim_val_t** argv, shim_val_t* rval)
 {
   assert(self != NULL);
   Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
 
   Local<String> str = OBJ_TO_STRING(SHIM_TO_VAL(sym));
 
-  rval->handle = *shim_call_func(recv, str, argc, argv);
+  SHIM_VAL_SET(rval, *shim_call_func(recv, str, argc, argv));
 
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
@@ -938,12 +2845,35 @@ shim_func_call_name(shim_ctx_t* ctx, shim_val_t* self, const char* name,
   assert(self != NULL);
   Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
 
-  rval->handle = *shim_call_func(recv, String::NewSymbol(name), argc, argv);
+  SHIM_VAL_SET(rval,
+    *shim_call_func(recv, String::NewSymbol(name), argc, argv));
   
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
 }
 
+/**
+ * \param ctx Currently executing context
+ * \param self The this parameter of the function call
+ * \param atom The atom naming the function
+ * \param argc The number of args to pass the function
+ * \param argv The array of arguments to pass to the function
+ * \param rval The return value of the function
+ * \return TRUE if the function succeeded, otherwise FALSE
+ */
+shim_bool_t
+shim_func_call_atom(shim_ctx_t* ctx, shim_val_t* self, shim_atom_t* atom,
+  size_t argc, shim_val_t** argv, shim_val_t* rval)
+{
+  assert(self != NULL);
+  Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
+
+  SHIM_VAL_SET(rval, *shim_call_func(recv, ATOM_TO_STR(atom), argc, argv));
+
+  TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
+  return !tr->HasCaught();
+}
+
 /**
  * \param ctx Currently executing context
  * \param self The this parameter of the function call
@@ -966,9 +2896,9 @@ shim_func_call_val(shim_ctx_t* ctx, shim_val_t* self, shim_val_t* func,
   if (self != NULL)
     recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
   else
-    recv = Object::New();
+    recv = shim_default_receiver(ctx);
 
-  rval->handle = *shim_call_func(recv, fn, argc, argv);
+  SHIM_VAL_SET(rval, *shim_call_func(recv, fn, argc, argv));
 
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
@@ -992,11 +2922,9 @@ shim_make_callback_sym(shim_ctx_t* ctx, shim_val_t* self, shim_val_t* sym,
   Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
   Local<String> jsym = OBJ_TO_STRING(SHIM_TO_VAL(sym));
 
-  Local<Value>* jsargs = shim_vals_to_handles(argc, argv);
-
-  rval->handle = *node::MakeCallback(recv, jsym, argc, jsargs);
+  HandleArgs jsargs(argc, argv);
 
-  delete jsargs;
+  SHIM_VAL_SET(rval, *node::MakeCallback(recv, jsym, argc, *jsargs));
 
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
@@ -1018,21 +2946,19 @@ shim_make_callback_val(shim_ctx_t* ctx, shim_val_t* self, shim_val_t* fval,
   /* TODO check is valid */
   Local<Value> prop = SHIM_TO_VAL(fval);
   Local<Function> fn = Local<Function>::Cast(prop);
-  Local<Value>* jsargs = shim_vals_to_handles(argc, argv);
+  HandleArgs jsargs(argc, argv);
 
   Local<Object> recv;
 
   if (self != NULL) {
     recv = OBJ_TO_OBJECT(SHIM_TO_VAL(self));
   } else {
-    recv = Object::New();
+    recv = shim_default_receiver(ctx);
   }
 
-  Handle<Value> ret = node::MakeCallback(recv, fn, argc, jsargs);
+  Handle<Value> ret = node::MakeCallback(recv, fn, argc, *jsargs);
 
-  rval->handle = *ret;
-
-  delete jsargs;
+  SHIM_VAL_SET(rval, *ret);
 
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
@@ -1053,69 +2979,199 @@ shim_make_callback_name(shim_ctx_t* ctx, shim_val_t* obj, const char* name,
 {
   assert(obj != NULL);
 
-  Local<Value>* jsargs = shim_vals_to_handles(argc, argv);
+  HandleArgs jsargs(argc, argv);
   Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
 
-  Handle<Value> ret = node::MakeCallback(recv, name, argc, jsargs);
-
-  rval->handle = *ret;
+  Handle<Value> ret = node::MakeCallback(recv, name, argc, *jsargs);
 
-  delete jsargs;
+  SHIM_VAL_SET(rval, *ret);
 
   TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
   return !tr->HasCaught();
 }
 
 /**
- * \param ctx Current executing context
- * \param d The value of the new number
- * \return The wrapped number
+ * \param ctx Currently executing context
+ * \param obj The this parameter of the function call
+ * \param atom The atom naming the function
+ * \param argc The number of args to pass the function
+ * \param argv The array of arguments to pass to the function
+ * \param rval The return value of the function
+ * \return TRUE if the function succeeded, otherwise FALSE
  */
-shim_val_t*
-shim_number_new(shim_ctx_t* ctx, double d)
+shim_bool_t
+shim_make_callback_atom(shim_ctx_t* ctx, shim_val_t* obj, shim_atom_t* atom,
+  size_t argc, shim_val_t** argv, shim_val_t* rval)
 {
-  return shim_val_alloc(ctx, Number::New(d));
+  assert(obj != NULL);
+
+  HandleArgs jsargs(argc, argv);
+  Local<Object> recv = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+
+  Handle<Value> ret = node::MakeCallback(recv, ATOM_TO_STR(atom), argc,
+    *jsargs);
+
+  SHIM_VAL_SET(rval, *ret);
+
+  TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
+  return !tr->HasCaught();
 }
 
 /**
- * \param val The given number
- * \return The value of the number
+ * \param ctx Currently executing context
+ * \param func The function to hold
+ * \param self The this parameter for each call, or NULL
+ * \return The held callback
+ *
+ * The function and receiver are kept in persistents so repeated calls
+ * neither look the function up nor allocate a receiver or argument array
  */
-double
-shim_number_value(shim_val_t* val)
+shim_callback_t*
+shim_callback_new(shim_ctx_t* ctx, shim_val_t* func, shim_val_t* self)
 {
-  return SHIM_TO_VAL(val)->NumberValue();
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  Local<Value> fh = SHIM_TO_VAL(func);
+  assert(fh->IsFunction());
+
+  shim_callback_t* cb = new shim_callback_t;
+  cb->func = Persistent<Function>::New(
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+    isolate,
+#endif
+    fh.As<Function>());
+
+  if (self != NULL)
+    cb->recv = Persistent<Object>::New(
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+      isolate,
+#endif
+      OBJ_TO_OBJECT(SHIM_TO_VAL(self)));
+
+  return cb;
 }
 
-/**
- * \param ctx Current executing context
- * \param i The value of the new integer
- * \return The wrapped integer
- */
-shim_val_t*
-shim_integer_new(shim_ctx_t* ctx, int32_t i)
+
+Local<Object>
+shim_callback_recv(shim_ctx_t* ctx, shim_callback_t* cb)
 {
-  return shim_val_alloc(ctx, Integer::New(i));
+  if (cb->recv.IsEmpty())
+    return shim_default_receiver(ctx);
+  return Local<Object>(*cb->recv);
 }
 
 /**
- * \param ctx Current executing context
- * \param i The value of the new integer
- * \return The wrapped integer
+ * \param ctx Currently executing context
+ * \param cb The held callback
+ * \param argc The number of args to pass the function
+ * \param argv The array of arguments to pass to the function
+ * \param rval The return value of the function, may be NULL
+ * \return TRUE if the function succeeded, otherwise FALSE
  */
-shim_val_t*
-shim_integer_uint(shim_ctx_t* ctx, uint32_t i)
+shim_bool_t
+shim_callback_call(shim_ctx_t* ctx, shim_callback_t* cb, size_t argc,
+  shim_val_t** argv, shim_val_t* rval)
 {
-  return shim_val_alloc(ctx, Integer::NewFromUnsigned(i));
-}
+  HandleArgs jsargs(argc, argv);
+  Local<Function> fn(*cb->func);
+  Local<Value> ret = fn->Call(shim_callback_recv(ctx, cb), argc, *jsargs);
 
-/**
- * \param val The given integer
+  if (rval != NULL)
+    SHIM_VAL_SET(rval, *ret);
+
+  TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
+  return !tr->HasCaught();
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param cb The held callback
+ * \param argc The number of args to pass the function
+ * \param argv The array of arguments to pass to the function
+ * \param rval The return value of the function, may be NULL
+ * \return TRUE if the function succeeded, otherwise FALSE
+ */
+shim_bool_t
+shim_callback_make(shim_ctx_t* ctx, shim_callback_t* cb, size_t argc,
+  shim_val_t** argv, shim_val_t* rval)
+{
+  HandleArgs jsargs(argc, argv);
+  Local<Function> fn(*cb->func);
+  Handle<Value> ret = node::MakeCallback(shim_callback_recv(ctx, cb), fn,
+    argc, *jsargs);
+
+  if (rval != NULL)
+    SHIM_VAL_SET(rval, *ret);
+
+  TryCatch *tr = static_cast<TryCatch*>(ctx->trycatch);
+  return !tr->HasCaught();
+}
+
+/**
+ * \param cb The held callback to release
+ */
+void
+shim_callback_dispose(shim_callback_t* cb)
+{
+  cb->func.Dispose();
+  if (!cb->recv.IsEmpty())
+    cb->recv.Dispose();
+  delete cb;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param d The value of the new number
+ * \return The wrapped number
+ */
+shim_val_t*
+shim_number_new(shim_ctx_t* ctx, double d)
+{
+  return shim_val_alloc(ctx, Number::New(d));
+}
+
+/**
+ * \param val The given number
+ * \return The value of the number
+ */
+double
+shim_number_value(shim_val_t* val)
+{
+  if (SHIM_VAL_UNBOXED(val))
+    return val->num;
+  return SHIM_TO_VAL(val)->NumberValue();
+}
+
+/**
+ * \param ctx Current executing context
+ * \param i The value of the new integer
+ * \return The wrapped integer
+ */
+shim_val_t*
+shim_integer_new(shim_ctx_t* ctx, int32_t i)
+{
+  return shim_val_alloc(ctx, Integer::New(i));
+}
+
+/**
+ * \param ctx Current executing context
+ * \param i The value of the new integer
+ * \return The wrapped integer
+ */
+shim_val_t*
+shim_integer_uint(shim_ctx_t* ctx, uint32_t i)
+{
+  return shim_val_alloc(ctx, Integer::NewFromUnsigned(i));
+}
+
+/**
+ * \param val The given integer
  * \return The value of the integer
  */
 int64_t
 shim_integer_value(shim_val_t* val)
 {
+  if (SHIM_VAL_UNBOXED(val))
+    return shim_num_to_int64(val->num);
   return SHIM_TO_VAL(val)->IntegerValue();
 }
 
@@ -1126,6 +3182,8 @@ shim_integer_value(shim_val_t* val)
 int32_t
 shim_integer_int32_value(shim_val_t* val)
 {
+  if (SHIM_VAL_UNBOXED(val))
+    return static_cast<int32_t>(shim_num_to_uint32(val->num));
   return SHIM_TO_VAL(val)->Int32Value();
 }
 
@@ -1136,9 +3194,115 @@ shim_integer_int32_value(shim_val_t* val)
 uint32_t
 shim_integer_uint32_value(shim_val_t* val)
 {
+  if (SHIM_VAL_UNBOXED(val))
+    return shim_num_to_uint32(val->num);
   return SHIM_TO_VAL(val)->Uint32Value();
 }
 
+/*
+ * Text is usually mostly ASCII, so the leading run of ASCII is found a vector
+ * at a time, the first vector with a high bit set is finished byte by byte
+ */
+size_t
+shim_ascii_prefix(const char* data, size_t len)
+{
+  size_t i = 0;
+
+#if SHIM_SIMD_AVX2
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    if (_mm256_movemask_epi8(v) != 0)
+      break;
+  }
+#endif
+
+#if SHIM_SIMD_SSE2
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    if (_mm_movemask_epi8(v) != 0)
+      break;
+  }
+#elif SHIM_SIMD_NEON
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+    if (vmaxvq_u8(v) >= 0x80)
+      break;
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    if (v & 0x8080808080808080ULL)
+      break;
+  }
+#endif
+
+  for (; i < len; i++)
+    if (static_cast<unsigned char>(data[i]) & 0x80)
+      break;
+
+  return i;
+}
+
+/**
+ * \param data The bytes to check
+ * \param len The number of bytes in \a data
+ * \return TRUE if \a data is well formed UTF-8, otherwise FALSE
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF are rejected.
+ * Runs of ASCII are skipped a vector at a time.
+ *
+ * shim_string_new_copyn() doesn't call this, V8 already decodes malformed
+ * input to U+FFFD and checking first would scan every string twice. Call it
+ * before creating a string when bad input has to be refused instead.
+ */
+shim_bool_t
+shim_utf8_valid(const char* data, size_t len)
+{
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+  size_t i = 0;
+
+  for (;;) {
+    i += shim_ascii_prefix(data + i, len - i);
+
+    if (i == len)
+      return TRUE;
+
+    /* the range of the second byte is what rules out the invalid forms */
+    unsigned char c = s[i];
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    size_t n;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+      n = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      n = 2;
+      if (c == 0xE0)
+        lo = 0xA0;
+      else if (c == 0xED)
+        hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      n = 3;
+      if (c == 0xF0)
+        lo = 0x90;
+      else if (c == 0xF4)
+        hi = 0x8F;
+    } else {
+      return FALSE;
+    }
+
+    if (len - i - 1 < n || s[i + 1] < lo || s[i + 1] > hi)
+      return FALSE;
+
+    for (size_t k = 2; k <= n; k++)
+      if ((s[i + k] & 0xC0) != 0x80)
+        return FALSE;
+
+    i += n + 1;
+  }
+}
+
 /**
  * \param ctx Current executing context
  * \return Wrapped empty string
@@ -1157,7 +3321,7 @@ shim_string_new(shim_ctx_t* ctx)
 shim_val_t*
 shim_string_new_copy(shim_ctx_t* ctx, const char* data)
 {
-  return shim_val_alloc(ctx, String::New(data));
+  return shim_string_new_copyn(ctx, data, strlen(data));
 }
 
 /**
@@ -1165,11 +3329,22 @@ shim_string_new_copy(shim_ctx_t* ctx, const char* data)
  * \param data Source string
  * \param len Length of created string
  * \return The wrapped string
+ *
+ * Malformed UTF-8 becomes U+FFFD, use shim_utf8_valid() to reject it instead
  */
 shim_val_t*
 shim_string_new_copyn(shim_ctx_t* ctx, const char* data, size_t len)
 {
-  return shim_val_alloc(ctx, String::New(data, len));
+#if SHIM_ONE_BYTE_STRINGS
+  /* ASCII is copied as is into a one byte string, skipping the decoder */
+  if (shim_ascii_prefix(data, len) == len)
+    return shim_val_alloc(ctx, String::NewFromOneByte(
+      static_cast<Isolate*>(ctx->isolate),
+      reinterpret_cast<const uint8_t*>(data), String::kNormalString,
+      static_cast<int>(len)), SHIM_TYPE_STRING);
+#endif
+
+  return shim_val_alloc(ctx, String::New(data, len), SHIM_TYPE_STRING);
 }
 
 /**
@@ -1201,8 +3376,62 @@ shim_string_length_utf8(shim_val_t* val)
 const char*
 shim_string_value(shim_val_t* val)
 {
-  String::Utf8Value str(OBJ_TO_STRING(SHIM_TO_VAL(val)));
-  return strdup(*str);
+  Local<String> str = OBJ_TO_STRING(SHIM_TO_VAL(val));
+
+#if SHIM_ONE_BYTE_STRINGS
+  /* a one byte string is Latin-1, ASCII is already UTF-8 */
+  if (str->IsOneByte()) {
+    size_t n = str->Length();
+    char* buf = static_cast<char*>(malloc(n + 1));
+    str->WriteOneByte(reinterpret_cast<uint8_t*>(buf), 0, n,
+      String::NO_NULL_TERMINATION);
+
+    size_t i = shim_ascii_prefix(buf, n);
+    size_t extra = 0;
+
+    for (size_t k = i; k < n; k++)
+      extra += static_cast<unsigned char>(buf[k]) >> 7;
+
+    /* every other byte grows to two, so widen in place from the end */
+    if (extra > 0)
+      buf = static_cast<char*>(realloc(buf, n + extra + 1));
+
+    char* out = buf + n + extra;
+    *out = '\0';
+
+    for (size_t k = n; extra > 0 && k > i; k--) {
+      unsigned char c = static_cast<unsigned char>(buf[k - 1]);
+      if (c < 0x80) {
+        *--out = static_cast<char>(c);
+      } else {
+        *--out = static_cast<char>(0x80 | (c & 0x3F));
+        *--out = static_cast<char>(0xC0 | (c >> 6));
+      }
+    }
+
+    return buf;
+  }
+#endif
+
+  int len = str->Utf8Length();
+  char* buf = static_cast<char*>(malloc(len + 1));
+  str->WriteUtf8(buf, len + 1);
+  return buf;
+}
+
+
+int
+shim_string_options(int32_t options)
+{
+  int ret = String::NO_OPTIONS;
+
+  if (options & SHIM_STRING_HINT_MANY_WRITES)
+    ret |= String::HINT_MANY_WRITES_EXPECTED;
+
+  if (options & SHIM_STRING_NO_NULL_TERMINATION)
+    ret |= String::NO_NULL_TERMINATION;
+
+  return ret;
 }
 
 /**
@@ -1210,13 +3439,126 @@ shim_string_value(shim_val_t* val)
  * \param buff The destination buffer
  * \param start The starting position to encode
  * \param len The length of the string to create
- * \param options The options for how to encode the string
+ * \param options The ::shim_string_flags_t for how to encode the string
  */
 size_t
 shim_string_write_ascii(shim_val_t* val, char* buff, size_t start, size_t len,
   int32_t options)
 {
-  return OBJ_TO_STRING(SHIM_TO_VAL(val))->WriteAscii(buff, start, len);
+  return OBJ_TO_STRING(SHIM_TO_VAL(val))->WriteAscii(buff, start, len,
+    shim_string_options(options));
+}
+
+/**
+ * \param val The given string
+ * \param buff The destination buffer
+ * \param cap The size of \a buff in bytes
+ * \param nchars Set to the number of characters written (may be NULL)
+ * \param options The ::shim_string_flags_t for how to encode the string
+ * \return The number of bytes written, including any NUL
+ *
+ * Writes directly into \a buff, only whole characters are written so the
+ * result is always valid UTF-8
+ */
+size_t
+shim_string_write_utf8(shim_val_t* val, char* buff, size_t cap,
+  size_t* nchars, int32_t options)
+{
+  int chars = 0;
+  int ret = OBJ_TO_STRING(SHIM_TO_VAL(val))->WriteUtf8(buff, cap, &chars,
+    shim_string_options(options));
+
+  if (nchars != NULL)
+    *nchars = chars;
+
+  return ret;
+}
+
+/**
+ * \param val The given string
+ * \param data Set to the memory of the string
+ * \param len Set to the length of the string
+ * \return TRUE if the string could be borrowed, otherwise FALSE
+ *
+ * Only one byte external strings (like those made by
+ * shim_string_new_external()) can be borrowed, the memory is valid as long
+ * as the string is alive. Fall back to shim_string_write_utf8() when this
+ * returns FALSE.
+ */
+shim_bool_t
+shim_string_borrow(shim_val_t* val, const char** data, size_t* len)
+{
+  Local<Value> v = SHIM_TO_VAL(val);
+
+  if (!v->IsString())
+    return FALSE;
+
+  Local<String> str = v.As<String>();
+
+  if (!str->IsExternalAscii())
+    return FALSE;
+
+  const String::ExternalAsciiStringResource* res =
+    str->GetExternalAsciiStringResource();
+
+  *data = res->data();
+  *len = res->length();
+  return TRUE;
+}
+
+
+class ExternalString : public String::ExternalAsciiStringResource {
+ public:
+  ExternalString(char* data, size_t len, shim_buffer_free cb, void* hint)
+    : data_(data), len_(len), cb_(cb), hint_(hint) {}
+
+  ~ExternalString() {
+    if (cb_ != NULL)
+      cb_(data_, hint_);
+  }
+
+  const char* data() const { return data_; }
+  size_t length() const { return len_; }
+
+ private:
+  char* data_;
+  size_t len_;
+  shim_buffer_free cb_;
+  void* hint_;
+};
+
+
+shim_bool_t
+shim_is_ascii(const char* data, size_t len)
+{
+  return shim_ascii_prefix(data, len) == len;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param data The characters of the string
+ * \param len The length of \a data in bytes
+ * \param cb Callback that is called when the string is to be freed
+ * \param hint Arbitrary data passed to the callback
+ * \return The wrapped string
+ *
+ * ASCII data is used in place and never copied onto the JavaScript heap.
+ * Anything else is decoded as UTF-8 into a regular string, in which case
+ * \a cb is called before this returns.
+ */
+shim_val_t*
+shim_string_new_external(shim_ctx_t* ctx, char* data, size_t len,
+  shim_buffer_free cb, void* hint)
+{
+  if (!shim_is_ascii(data, len)) {
+    Local<String> str = String::New(data, len);
+    if (cb != NULL)
+      cb(data, hint);
+    return shim_val_alloc(ctx, str, SHIM_TYPE_STRING);
+  }
+
+  ExternalString* res = new ExternalString(data, len, cb, hint);
+  return shim_val_alloc(ctx, String::NewExternal(res), SHIM_TYPE_STRING);
 }
 
 /**
@@ -1250,7 +3592,7 @@ shim_array_length(shim_val_t* arr)
 shim_bool_t
 shim_array_get(shim_ctx_t* ctx, shim_val_t* arr, int32_t idx, shim_val_t* rval)
 {
-  rval->handle = *OBJ_TO_ARRAY(SHIM_TO_VAL(arr))->Get(idx);
+  SHIM_VAL_SET(rval, *OBJ_TO_ARRAY(SHIM_TO_VAL(arr))->Get(idx));
   return TRUE;
 }
 
@@ -1267,491 +3609,2946 @@ shim_array_set(shim_ctx_t* ctx, shim_val_t* arr, int32_t idx, shim_val_t* val)
   return OBJ_TO_ARRAY(SHIM_TO_VAL(arr))->Set(idx, SHIM_TO_VAL(val));
 }
 
-/**
- * \param ctx Current executing context
- * \param len Size of buffer to create
- * \return Wrapped buffer
- */
-shim_val_t*
-shim_buffer_new(shim_ctx_t* ctx, size_t len)
+/* elements are converted in blocks, each under its own HandleScope */
+#define SHIM_ARRAY_BLOCK 1024
+
+
+size_t
+shim_array_ctype_size(shim_type_t type)
 {
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  return shim_val_alloc(ctx, node::Buffer::New(len));
-#else
-  return shim_val_alloc(ctx, Buffer::New(len)->handle_);
-#endif
+  switch(type) {
+    case SHIM_TYPE_BOOL:
+      return sizeof(shim_bool_t);
+    case SHIM_TYPE_INT32:
+      return sizeof(int32_t);
+    case SHIM_TYPE_UINT32:
+      return sizeof(uint32_t);
+    case SHIM_TYPE_INTEGER:
+      return sizeof(int64_t);
+    case SHIM_TYPE_NUMBER:
+      return sizeof(double);
+    default:
+      return 0;
+  }
 }
 
-/**
- * \param ctx Current executing context
- * \param data Data to be copied
- * \param len Length of data to be copied
- * \return Wrapped buffer
- */
-shim_val_t*
-shim_buffer_new_copy(shim_ctx_t* ctx, const char* data, size_t len)
+
+/* The typed array element type laid out exactly like the C type */
+shim_typedarray_type_t
+shim_array_ctype_twin(shim_type_t type)
 {
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  return shim_val_alloc(ctx, node::Buffer::New(data, len));
-#elif NODE_VERSION_AT_LEAST(0, 10, 0)
-  return shim_val_alloc(ctx, Buffer::New(data, len)->handle_);
-#else
-  return shim_val_alloc(ctx, Buffer::New((char*)data, len)->handle_);
-#endif
+  switch(type) {
+    case SHIM_TYPE_INT32:
+      return SHIM_TYPEDARRAY_INT32;
+    case SHIM_TYPE_UINT32:
+      return SHIM_TYPEDARRAY_UINT32;
+    case SHIM_TYPE_NUMBER:
+      return SHIM_TYPEDARRAY_FLOAT64;
+    default:
+      return SHIM_TYPEDARRAY_UNKNOWN;
+  }
 }
 
-/**
- * \param ctx Current executing context
- * \param data Data to be used for underlying memory
- * \param len Size of memory being used
- * \param cb Callback that is called when buffer is to be freed
- * \param hint Arbitrary data passed to the callback
- * \return Wrapped buffer
- *
- * The underlying memory is not copied, but used in place
- */
-shim_val_t*
-shim_buffer_new_external(shim_ctx_t* ctx, char* data, size_t len,
-  shim_buffer_free cb, void* hint)
+
+double
+shim_elem_get(const void* data, shim_typedarray_type_t type, size_t i)
 {
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  return shim_val_alloc(ctx, node::Buffer::New(data, len, cb, hint));
-#else
-  return shim_val_alloc(ctx, Buffer::New(data, len, cb, hint)->handle_);
-#endif
+  switch(type) {
+    case SHIM_TYPEDARRAY_INT8:
+      return static_cast<const int8_t*>(data)[i];
+    case SHIM_TYPEDARRAY_UINT8:
+    case SHIM_TYPEDARRAY_UINT8_CLAMPED:
+      return static_cast<const uint8_t*>(data)[i];
+    case SHIM_TYPEDARRAY_INT16:
+      return static_cast<const int16_t*>(data)[i];
+    case SHIM_TYPEDARRAY_UINT16:
+      return static_cast<const uint16_t*>(data)[i];
+    case SHIM_TYPEDARRAY_INT32:
+      return static_cast<const int32_t*>(data)[i];
+    case SHIM_TYPEDARRAY_UINT32:
+      return static_cast<const uint32_t*>(data)[i];
+    case SHIM_TYPEDARRAY_FLOAT32:
+      return static_cast<const float*>(data)[i];
+    case SHIM_TYPEDARRAY_FLOAT64:
+      return static_cast<const double*>(data)[i];
+    default:
+      return 0;
+  }
 }
 
-/**
- * \param val THe given buffer
- * \return Pointer to the underlying memory
- */
-char*
-shim_buffer_value(shim_val_t* val)
+
+void
+shim_elem_set(void* data, shim_typedarray_type_t type, size_t i, double d)
 {
-  Local<Value>v(SHIM_TO_VAL(val));
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  switch(type) {
+    case SHIM_TYPEDARRAY_INT8:
+      static_cast<int8_t*>(data)[i] = static_cast<int8_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPEDARRAY_UINT8:
+      static_cast<uint8_t*>(data)[i] = static_cast<uint8_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPEDARRAY_UINT8_CLAMPED:
+      static_cast<uint8_t*>(data)[i] = shim_num_to_uint8_clamp(d);
+      break;
+    case SHIM_TYPEDARRAY_INT16:
+      static_cast<int16_t*>(data)[i] = static_cast<int16_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPEDARRAY_UINT16:
+      static_cast<uint16_t*>(data)[i] = static_cast<uint16_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPEDARRAY_INT32:
+      static_cast<int32_t*>(data)[i] = static_cast<int32_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPEDARRAY_UINT32:
+      static_cast<uint32_t*>(data)[i] = shim_num_to_uint32(d);
+      break;
+    case SHIM_TYPEDARRAY_FLOAT32:
+      static_cast<float*>(data)[i] = static_cast<float>(d);
+      break;
+    case SHIM_TYPEDARRAY_FLOAT64:
+      static_cast<double*>(data)[i] = d;
+      break;
+    default:
+      break;
+  }
+}
+
+
+double
+shim_cval_get(const void* data, shim_type_t type, size_t i)
+{
+  switch(type) {
+    case SHIM_TYPE_BOOL:
+      return static_cast<const shim_bool_t*>(data)[i] ? 1 : 0;
+    case SHIM_TYPE_INT32:
+      return static_cast<const int32_t*>(data)[i];
+    case SHIM_TYPE_UINT32:
+      return static_cast<const uint32_t*>(data)[i];
+    case SHIM_TYPE_INTEGER:
+      return static_cast<double>(static_cast<const int64_t*>(data)[i]);
+    case SHIM_TYPE_NUMBER:
+    default:
+      return static_cast<const double*>(data)[i];
+  }
+}
+
+
+void
+shim_cval_set(void* data, shim_type_t type, size_t i, double d)
+{
+  switch(type) {
+    case SHIM_TYPE_BOOL:
+      /* NaN is falsy too */
+      static_cast<shim_bool_t*>(data)[i] = d != 0 && d == d;
+      break;
+    case SHIM_TYPE_INT32:
+      static_cast<int32_t*>(data)[i] = static_cast<int32_t>(
+        shim_num_to_uint32(d));
+      break;
+    case SHIM_TYPE_UINT32:
+      static_cast<uint32_t*>(data)[i] = shim_num_to_uint32(d);
+      break;
+    case SHIM_TYPE_INTEGER:
+      static_cast<int64_t*>(data)[i] = shim_num_to_int64(d);
+      break;
+    case SHIM_TYPE_NUMBER:
+    default:
+      static_cast<double*>(data)[i] = d;
+      break;
+  }
+}
+
+
+/*
+ * Typed arrays are copied directly between their backing store and the C
+ * array, returns FALSE if arr isn't a typed array
+ */
+shim_bool_t
+shim_array_range_typed(shim_ctx_t* ctx, shim_val_t* arr, uint32_t start,
+  size_t n, shim_type_t type, void* cdata, shim_bool_t get,
+  shim_bool_t* ret)
+{
+  shim_typedarray_type_t ttype;
+  size_t tlen;
+  void* tdata = shim_typedarray_data(arr, &ttype, &tlen);
+
+  if (tdata == NULL || ttype == SHIM_TYPEDARRAY_UNKNOWN
+      || type == SHIM_TYPE_STRING)
+    return FALSE;
+
+  if (start > tlen || n > tlen - start) {
+    shim_throw_range_error(ctx, "Range %u+%u exceeds length %u", start,
+      static_cast<uint32_t>(n), static_cast<uint32_t>(tlen));
+    *ret = FALSE;
+    return TRUE;
+  }
+
+  if (ttype == shim_array_ctype_twin(type)) {
+    size_t size = shim_array_ctype_size(type);
+    char* elems = static_cast<char*>(tdata) + start * size;
+
+    if (get)
+      memcpy(cdata, elems, n * size);
+    else
+      memcpy(elems, cdata, n * size);
+  } else if (get) {
+    for (size_t i = 0; i < n; i++)
+      shim_cval_set(cdata, type, i, shim_elem_get(tdata, ttype, start + i));
+  } else {
+    for (size_t i = 0; i < n; i++)
+      shim_elem_set(tdata, ttype, start + i, shim_cval_get(cdata, type, i));
+  }
+
+  *ret = TRUE;
+  return TRUE;
+}
+
+
+/**
+ * \param ctx Current executing context
+ * \param arr Given array or typed array
+ * \param start Index of the first element
+ * \param n Number of elements
+ * \param type The type of each element
+ * \param out The destination C array
+ * \return TRUE if every element was converted, otherwise FALSE
+ *
+ * \a out must have room for \a n of `double` (SHIM_TYPE_NUMBER), `int64_t`
+ * (SHIM_TYPE_INTEGER), `int32_t` (SHIM_TYPE_INT32), `uint32_t`
+ * (SHIM_TYPE_UINT32), ::shim_bool_t (SHIM_TYPE_BOOL) or ::shim_val_t
+ * (SHIM_TYPE_STRING). Typed arrays are copied straight out of their backing
+ * store, if an element is not of \a type FALSE is returned and an exception
+ * is set.
+ */
+shim_bool_t
+shim_array_get_range(shim_ctx_t* ctx, shim_val_t* arr, uint32_t start,
+  size_t n, shim_type_t type, void* out)
+{
+  shim_bool_t ret;
+
+  if (shim_array_range_typed(ctx, arr, start, n, type, out, TRUE, &ret))
+    return ret;
+
+  if (type != SHIM_TYPE_STRING && shim_array_ctype_size(type) == 0) {
+    shim_throw_type_error(ctx, "Can't unpack elements as %s",
+      shim_type_str(type));
+    return FALSE;
+  }
+
+  Local<Array> jsarr = OBJ_TO_ARRAY(SHIM_TO_VAL(arr));
+  shim_val_t* strs = static_cast<shim_val_t*>(out);
+  size_t i = 0;
+
+  /* strings are handed back as handles, so only they share the outer scope */
+  if (type == SHIM_TYPE_STRING) {
+    for (; i < n; i++) {
+      Local<Value> v = jsarr->Get(start + i);
+      if (!v->IsString())
+        break;
+      shim_val_init(&strs[i], v, SHIM_TYPE_STRING);
+    }
+  }
+
+  while (type != SHIM_TYPE_STRING && i < n) {
+    HandleScope scope;
+    size_t end = i + SHIM_ARRAY_BLOCK < n ? i + SHIM_ARRAY_BLOCK : n;
+
+    for (; i < end; i++) {
+      Local<Value> v = jsarr->Get(start + i);
+      shim_bool_t ok;
+
+      switch(type) {
+        case SHIM_TYPE_BOOL:
+          ok = v->IsBoolean();
+          if (ok)
+            static_cast<shim_bool_t*>(out)[i] = v->BooleanValue();
+          break;
+        case SHIM_TYPE_INT32:
+          ok = v->IsInt32();
+          if (ok)
+            static_cast<int32_t*>(out)[i] = v->Int32Value();
+          break;
+        case SHIM_TYPE_UINT32:
+          ok = v->IsUint32();
+          if (ok)
+            static_cast<uint32_t*>(out)[i] = v->Uint32Value();
+          break;
+        case SHIM_TYPE_INTEGER:
+          ok = v->IsNumber();
+          if (ok)
+            static_cast<int64_t*>(out)[i] = v->IntegerValue();
+          break;
+        case SHIM_TYPE_NUMBER:
+        default:
+          ok = v->IsNumber();
+          if (ok)
+            static_cast<double*>(out)[i] = v->NumberValue();
+          break;
+      }
+
+      if (!ok)
+        break;
+    }
+
+    if (i < end)
+      break;
+  }
+
+  if (i < n) {
+    shim_throw_type_error(ctx, "Element %u not of type %s",
+      static_cast<uint32_t>(start + i), shim_type_str(type));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param arr Given array or typed array
+ * \param start Index of the first element
+ * \param n Number of elements
+ * \param type The type of each element
+ * \param in The source C array
+ * \return TRUE if every element was set, otherwise FALSE
+ *
+ * \a in holds elements of the C type described in shim_array_get_range()
+ */
+shim_bool_t
+shim_array_set_range(shim_ctx_t* ctx, shim_val_t* arr, uint32_t start,
+  size_t n, shim_type_t type, const void* in)
+{
+  shim_bool_t ret;
+
+  if (shim_array_range_typed(ctx, arr, start, n, type, const_cast<void*>(in),
+        FALSE, &ret))
+    return ret;
+
+  if (type != SHIM_TYPE_STRING && shim_array_ctype_size(type) == 0) {
+    shim_throw_type_error(ctx, "Can't pack elements as %s",
+      shim_type_str(type));
+    return FALSE;
+  }
+
+  Local<Array> jsarr = OBJ_TO_ARRAY(SHIM_TO_VAL(arr));
+  size_t i = 0;
+
+  while (i < n) {
+    HandleScope scope;
+    size_t end = i + SHIM_ARRAY_BLOCK < n ? i + SHIM_ARRAY_BLOCK : n;
+
+    for (; i < end; i++) {
+      Local<Value> v;
+
+      switch(type) {
+        case SHIM_TYPE_STRING:
+          v = shim_val_handle(&static_cast<shim_val_t*>(
+            const_cast<void*>(in))[i]);
+          break;
+        case SHIM_TYPE_BOOL:
+          v = *Boolean::New(static_cast<const shim_bool_t*>(in)[i]);
+          break;
+        case SHIM_TYPE_INT32:
+          v = Integer::New(static_cast<const int32_t*>(in)[i]);
+          break;
+        case SHIM_TYPE_UINT32:
+          v = Integer::NewFromUnsigned(static_cast<const uint32_t*>(in)[i]);
+          break;
+        default:
+          v = Number::New(shim_cval_get(in, type, i));
+          break;
+      }
+
+      if (!jsarr->Set(start + i, v))
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/*
+ * Small Buffers can be carved out of shared slabs instead of each getting a
+ * backing store of its own. A slab holds a reference for each Buffer carved
+ * from it, plus one while it is the slab being carved from, and is freed with
+ * the last. The length of each Buffer is kept in front of it so the release
+ * can account for it.
+ */
+#define SHIM_BUFFER_SLAB (8 * 1024)
+#define SHIM_BUFFER_POOL_MAX 1024
+#define SHIM_BUFFER_POOL_ALIGN(n) (((n) + 7) & ~static_cast<size_t>(7))
+
+typedef struct shim_buffer_slab_s {
+  size_t refs;
+  size_t used;
+  char data[SHIM_BUFFER_SLAB];
+} shim_buffer_slab_t;
+
+
+typedef struct shim_buffer_pool_stats_s {
+  uint64_t slabs;
+  uint64_t views;
+  uint64_t bytes;
+} shim_buffer_pool_stats_t;
+
+
+int buffer_pool_enabled = FALSE;
+
+/* Buffers are released on the thread of their isolate */
+SHIM_THREAD_LOCAL shim_buffer_slab_t* buffer_slab = NULL;
+SHIM_THREAD_LOCAL shim_buffer_pool_stats_t buffer_pool_stats;
+
+
+void
+shim_buffer_slab_unref(shim_buffer_slab_t* slab)
+{
+  if (--slab->refs > 0)
+    return;
+
+  shim_external_adjust(Isolate::GetCurrent(), -SHIM_BUFFER_SLAB);
+  buffer_pool_stats.slabs--;
+  free(slab);
+}
+
+
+void
+shim_buffer_slab_release(char* data, void* hint)
+{
+  buffer_pool_stats.views--;
+  buffer_pool_stats.bytes -= *reinterpret_cast<size_t*>(data - sizeof(size_t));
+  shim_buffer_slab_unref(static_cast<shim_buffer_slab_t*>(hint));
+}
+
+
+Local<Value>
+shim_buffer_pooled(shim_ctx_t* ctx, const char* data, size_t len)
+{
+  size_t need = SHIM_BUFFER_POOL_ALIGN(sizeof(size_t) + len);
+  shim_buffer_slab_t* slab = buffer_slab;
+
+  if (slab == NULL || SHIM_BUFFER_SLAB - slab->used < need) {
+    if (slab != NULL)
+      shim_buffer_slab_unref(slab);
+
+    slab = static_cast<shim_buffer_slab_t*>(malloc(sizeof(*slab)));
+    slab->refs = 1;
+    slab->used = 0;
+    buffer_slab = slab;
+    buffer_pool_stats.slabs++;
+    shim_external_adjust(static_cast<Isolate*>(ctx->isolate),
+      SHIM_BUFFER_SLAB);
+  }
+
+  char* mem = slab->data + slab->used;
+  *reinterpret_cast<size_t*>(mem) = len;
+  mem += sizeof(size_t);
+
+  slab->used += need;
+  slab->refs++;
+  buffer_pool_stats.views++;
+  buffer_pool_stats.bytes += len;
+
+  if (data != NULL)
+    memcpy(mem, data, len);
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return node::Buffer::New(mem, len, shim_buffer_slab_release, slab);
+#else
+  return Buffer::New(mem, len, shim_buffer_slab_release, slab)->handle_;
+#endif
+}
+
+/**
+ * \param ctx Current executing context
+ * \param data Data to be copied, or NULL to leave the memory as it is
+ * \param len Length of the buffer
+ * \return Wrapped buffer
+ *
+ * Buffers up to 1 KiB share 8 KiB slabs, larger ones are made as usual
+ */
+shim_val_t*
+shim_buffer_new_pooled(shim_ctx_t* ctx, const char* data, size_t len)
+{
+  if (len > SHIM_BUFFER_POOL_MAX) {
+    if (data != NULL)
+      return shim_buffer_new_copy(ctx, data, len);
+    return shim_buffer_new(ctx, len);
+  }
+
+  return shim_val_alloc(ctx, shim_buffer_pooled(ctx, data, len));
+}
+
+/**
+ * \param enable TRUE to pool small buffers, FALSE to stop
+ *
+ * While enabled shim_buffer_new() and shim_buffer_new_copy() carve small
+ * buffers out of slabs like shim_buffer_new_pooled() does
+ */
+void
+shim_buffer_pool_enable(shim_bool_t enable)
+{
+  buffer_pool_enabled = enable;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param len Size of buffer to create
+ * \return Wrapped buffer
+ */
+shim_val_t*
+shim_buffer_new(shim_ctx_t* ctx, size_t len)
+{
+  if (buffer_pool_enabled && len <= SHIM_BUFFER_POOL_MAX)
+    return shim_val_alloc(ctx, shim_buffer_pooled(ctx, NULL, len));
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return shim_val_alloc(ctx, node::Buffer::New(len));
+#else
+  return shim_val_alloc(ctx, Buffer::New(len)->handle_);
+#endif
+}
+
+/**
+ * \param ctx Current executing context
+ * \param data Data to be copied
+ * \param len Length of data to be copied
+ * \return Wrapped buffer
+ */
+shim_val_t*
+shim_buffer_new_copy(shim_ctx_t* ctx, const char* data, size_t len)
+{
+  if (buffer_pool_enabled && len <= SHIM_BUFFER_POOL_MAX)
+    return shim_val_alloc(ctx, shim_buffer_pooled(ctx, data, len));
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return shim_val_alloc(ctx, node::Buffer::New(data, len));
+#elif NODE_VERSION_AT_LEAST(0, 10, 0)
+  return shim_val_alloc(ctx, Buffer::New(data, len)->handle_);
+#else
+  return shim_val_alloc(ctx, Buffer::New((char*)data, len)->handle_);
+#endif
+}
+
+typedef struct external_baton_s {
+  shim_buffer_free cb;
+  char* data;
+  void* hint;
+  /* bytes reported as external memory, given back when freed */
+  size_t size;
+} external_baton_t;
+
+
+void
+shim_external_baton_free(external_baton_t* baton)
+{
+  if (baton->size > 0)
+    shim_external_adjust(Isolate::GetCurrent(),
+      -static_cast<int64_t>(baton->size));
+  if (baton->cb != NULL)
+    baton->cb(baton->data, baton->hint);
+  delete baton;
+}
+
+
+/* node frees external Buffers itself, this settles the accounting first */
+void
+shim_buffer_free_accounted(char* data, void* hint)
+{
+  shim_external_baton_free(static_cast<external_baton_t*>(hint));
+}
+
+
+/**
+ * \param ctx Current executing context
+ * \param data Data to be used for underlying memory
+ * \param len Size of memory being used
+ * \param cb Callback that is called when buffer is to be freed
+ * \param hint Arbitrary data passed to the callback
+ * \return Wrapped buffer
+ *
+ * The underlying memory is not copied, but used in place
+ */
+shim_val_t*
+shim_buffer_new_external(shim_ctx_t* ctx, char* data, size_t len,
+  shim_buffer_free cb, void* hint)
+{
+  external_baton_t* baton = new external_baton_t;
+  baton->cb = cb;
+  baton->data = data;
+  baton->hint = hint;
+  baton->size = len;
+
+  shim_external_adjust(static_cast<Isolate*>(ctx->isolate), len);
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return shim_val_alloc(ctx, node::Buffer::New(data, len,
+    shim_buffer_free_accounted, baton));
+#else
+  return shim_val_alloc(ctx, Buffer::New(data, len,
+    shim_buffer_free_accounted, baton)->handle_);
+#endif
+}
+
+/**
+ * \param val THe given buffer
+ * \return Pointer to the underlying memory
+ */
+char*
+shim_buffer_value(shim_val_t* val)
+{
+  Local<Value>v(SHIM_TO_VAL(val));
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
   assert(node::Buffer::HasInstance(v));
   return node::Buffer::Data(v);
 #elif NODE_VERSION_AT_LEAST(0, 10, 0)
   assert(Buffer::HasInstance(v));
   return Buffer::Data(v);
 #else
-  assert(Buffer::HasInstance(v));
-  return Buffer::Data(v.As<Object>());
+  assert(Buffer::HasInstance(v));
+  return Buffer::Data(v.As<Object>());
+#endif
+}
+
+/**
+ * \param val The given buffer
+ * \return THe size of the buffer
+ */
+size_t
+shim_buffer_length(shim_val_t* val)
+{
+  Local<Value>v(SHIM_TO_VAL(val));
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  assert(node::Buffer::HasInstance(v));
+  return node::Buffer::Length(v);
+#elif NODE_VERSION_AT_LEAST(0, 10, 0)
+  assert(Buffer::HasInstance(v));
+  return Buffer::Length(v);
+#else
+  assert(Buffer::HasInstance(v));
+  return Buffer::Length(v.As<Object>());
+#endif
+}
+
+/*
+ * Writer chunks of the default size are recycled once JavaScript is done
+ * with them, like arena chunks the spares are kept per thread
+ */
+#define SHIM_BUFFER_CHUNK_DEFAULT (64 * 1024)
+#define SHIM_BUFFER_CHUNK_FREE_MAX 8
+
+SHIM_THREAD_LOCAL shim_buffer_chunk_t* buffer_chunk_free_list = NULL;
+SHIM_THREAD_LOCAL size_t buffer_chunk_free_count = 0;
+
+
+shim_buffer_chunk_t*
+shim_buffer_chunk_get(size_t size)
+{
+  shim_buffer_chunk_t* chunk;
+
+  if (size == SHIM_BUFFER_CHUNK_DEFAULT && buffer_chunk_free_list != NULL) {
+    chunk = buffer_chunk_free_list;
+    buffer_chunk_free_list = chunk->next;
+    buffer_chunk_free_count--;
+    return chunk;
+  }
+
+  chunk = static_cast<shim_buffer_chunk_t*>(
+    malloc(offset_of(shim_buffer_chunk_t, data) + size));
+  chunk->size = size;
+  return chunk;
+}
+
+
+void
+shim_buffer_chunk_put(shim_buffer_chunk_t* chunk)
+{
+  if (chunk->size == SHIM_BUFFER_CHUNK_DEFAULT
+      && buffer_chunk_free_count < SHIM_BUFFER_CHUNK_FREE_MAX) {
+    chunk->next = buffer_chunk_free_list;
+    buffer_chunk_free_list = chunk;
+    buffer_chunk_free_count++;
+  } else {
+    free(chunk);
+  }
+}
+
+
+void
+shim_buffer_chunk_release(char* data, void* hint)
+{
+  shim_buffer_chunk_put(static_cast<shim_buffer_chunk_t*>(hint));
+}
+
+
+Persistent<Array>
+shim_buffer_array_persist(shim_ctx_t* ctx, Local<Array> arr)
+{
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  return Persistent<Array>::New(static_cast<Isolate*>(ctx->isolate), arr);
+#else
+  return Persistent<Array>::New(arr);
+#endif
+}
+
+
+/* hand the current chunk to JavaScript, without copying it */
+void
+shim_buffer_writer_ship(shim_ctx_t* ctx, shim_buffer_writer_t* writer)
+{
+  if (writer->cur == NULL || writer->used == 0)
+    return;
+
+  shim_buffer_chunk_t* chunk = writer->cur;
+  shim_val_t* buf = shim_buffer_new_external(ctx, chunk->data, writer->used,
+    shim_buffer_chunk_release, chunk);
+  Local<Array>(*writer->chunks)->Set(writer->nchunks++, SHIM_TO_VAL(buf));
+  shim_value_release(buf);
+
+  writer->cur = NULL;
+  writer->used = 0;
+  writer->reserved = 0;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param chunk_size The size of each chunk, 0 for the default of 64 KiB
+ * \return The writer
+ *
+ * Chunks are handed to JavaScript as external Buffers when they are full, so
+ * what was written is never copied again
+ */
+shim_buffer_writer_t*
+shim_buffer_writer_new(shim_ctx_t* ctx, size_t chunk_size)
+{
+  shim_buffer_writer_t* writer = new shim_buffer_writer_t;
+  writer->chunks = shim_buffer_array_persist(ctx, Array::New());
+  writer->nchunks = 0;
+  writer->cur = NULL;
+  writer->used = 0;
+  writer->reserved = 0;
+  writer->chunk_size = chunk_size > 0 ? chunk_size : SHIM_BUFFER_CHUNK_DEFAULT;
+  writer->total = 0;
+  return writer;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param writer The given writer
+ * \param data The bytes to append
+ * \param len The number of bytes in \a data
+ * \return TRUE
+ */
+shim_bool_t
+shim_buffer_writer_write(shim_ctx_t* ctx, shim_buffer_writer_t* writer,
+  const char* data, size_t len)
+{
+  while (len > 0) {
+    if (writer->cur == NULL)
+      writer->cur = shim_buffer_chunk_get(writer->chunk_size);
+
+    size_t n = writer->chunk_size - writer->used;
+    if (n > len)
+      n = len;
+
+    memcpy(writer->cur->data + writer->used, data, n);
+    writer->used += n;
+    writer->total += n;
+    data += n;
+    len -= n;
+
+    if (writer->used == writer->chunk_size)
+      shim_buffer_writer_ship(ctx, writer);
+  }
+
+  return TRUE;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param writer The given writer
+ * \param len The number of contiguous bytes wanted
+ * \return Where to write up to \a len bytes, or NULL if \a len is larger than
+ * a chunk
+ *
+ * Encode into the returned memory directly, then say how much was used with
+ * shim_buffer_writer_commit()
+ */
+char*
+shim_buffer_writer_reserve(shim_ctx_t* ctx, shim_buffer_writer_t* writer,
+  size_t len)
+{
+  writer->reserved = 0;
+
+  if (len > writer->chunk_size)
+    return NULL;
+
+  if (writer->cur != NULL && writer->chunk_size - writer->used < len)
+    shim_buffer_writer_ship(ctx, writer);
+
+  if (writer->cur == NULL)
+    writer->cur = shim_buffer_chunk_get(writer->chunk_size);
+
+  writer->reserved = len;
+  return writer->cur->data + writer->used;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param writer The given writer
+ * \param len The number of reserved bytes that were written, anything past
+ * what was reserved is ignored
+ *
+ * A chunk this fills is handed to JavaScript straight away, like one filled
+ * by shim_buffer_writer_write()
+ */
+void
+shim_buffer_writer_commit(shim_ctx_t* ctx, shim_buffer_writer_t* writer,
+  size_t len)
+{
+  if (len > writer->reserved)
+    len = writer->reserved;
+
+  writer->reserved = 0;
+  writer->used += len;
+  writer->total += len;
+
+  if (writer->used == writer->chunk_size)
+    shim_buffer_writer_ship(ctx, writer);
+}
+
+/**
+ * \param ctx Current executing context
+ * \param writer The given writer
+ * \return An array of the Buffers filled since the last call
+ *
+ * The partly filled chunk is included, and writing continues in a new one
+ */
+shim_val_t*
+shim_buffer_writer_chunks(shim_ctx_t* ctx, shim_buffer_writer_t* writer)
+{
+  shim_buffer_writer_ship(ctx, writer);
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  Local<Array> chunks = Local<Array>::New(static_cast<Isolate*>(ctx->isolate),
+    writer->chunks);
+#else
+  Local<Array> chunks = Local<Array>::New(writer->chunks);
+#endif
+  writer->chunks.Dispose();
+  writer->chunks = shim_buffer_array_persist(ctx, Array::New());
+  writer->nchunks = 0;
+
+  return shim_val_alloc(ctx, chunks, SHIM_TYPE_ARRAY);
+}
+
+/**
+ * \param writer The given writer
+ * \return The number of bytes written in total
+ */
+size_t
+shim_buffer_writer_length(shim_buffer_writer_t* writer)
+{
+  return writer->total;
+}
+
+/**
+ * \param writer The writer to free
+ *
+ * Buffers already handed to JavaScript stay valid
+ */
+void
+shim_buffer_writer_free(shim_buffer_writer_t* writer)
+{
+  if (writer->cur != NULL)
+    shim_buffer_chunk_put(writer->cur);
+  writer->chunks.Dispose();
+  delete writer;
+}
+
+
+/* move to the next chunk once the current one is used up */
+shim_bool_t
+shim_buffer_reader_load(shim_buffer_reader_t* reader)
+{
+  while (reader->off == reader->len) {
+    if (reader->next == reader->nchunks)
+      return FALSE;
+
+    shim_val_t buf;
+    shim_val_init(&buf, Local<Array>(*reader->chunks)->Get(reader->next++));
+    reader->data = shim_buffer_value(&buf);
+    reader->len = shim_buffer_length(&buf);
+    reader->off = 0;
+  }
+
+  return TRUE;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param chunks A Buffer or an array of Buffers
+ * \return The reader, or NULL with a TypeError pending if \a chunks isn't
+ * made of Buffers
+ */
+shim_buffer_reader_t*
+shim_buffer_reader_new(shim_ctx_t* ctx, shim_val_t* chunks)
+{
+  Local<Value> val = SHIM_TO_VAL(chunks);
+  Local<Array> src;
+
+  if (val->IsArray()) {
+    src = val.As<Array>();
+  } else {
+    src = Array::New(1);
+    src->Set(0, val);
+  }
+
+  size_t remaining = 0;
+  uint32_t n = src->Length();
+  Local<Array> arr = Array::New(n);
+
+  /* what is checked here is what gets read, whatever happens to src */
+  for (uint32_t i = 0; i < n; i++) {
+    Local<Value> elem = src->Get(i);
+    shim_val_t buf;
+    shim_val_init(&buf, elem);
+
+    if (!shim::shim_value_is(&buf, SHIM_TYPE_BUFFER)) {
+      shim_throw_type_error(ctx, "Chunk %u is not a Buffer", i);
+      return NULL;
+    }
+
+    arr->Set(i, elem);
+    remaining += shim_buffer_length(&buf);
+  }
+
+  shim_buffer_reader_t* reader = new shim_buffer_reader_t;
+  reader->chunks = shim_buffer_array_persist(ctx, arr);
+  reader->nchunks = n;
+  reader->next = 0;
+  reader->data = NULL;
+  reader->len = 0;
+  reader->off = 0;
+  reader->remaining = remaining;
+  return reader;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param reader The given reader
+ * \param data Set to the unread memory of the current chunk
+ * \param len Set to the number of bytes at \a data
+ * \return FALSE once every chunk has been read, otherwise TRUE
+ *
+ * The memory belongs to the Buffer, nothing is copied
+ */
+shim_bool_t
+shim_buffer_reader_next(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  char** data, size_t* len)
+{
+  if (!shim_buffer_reader_load(reader))
+    return FALSE;
+
+  *data = reader->data + reader->off;
+  *len = reader->len - reader->off;
+  reader->remaining -= *len;
+  reader->off = reader->len;
+  return TRUE;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param reader The given reader
+ * \param len Set to the number of contiguous bytes available
+ * \return The unread memory of the current chunk, or NULL at the end
+ *
+ * Nothing is consumed, follow with shim_buffer_reader_skip()
+ */
+char*
+shim_buffer_reader_peek(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  size_t* len)
+{
+  if (!shim_buffer_reader_load(reader)) {
+    *len = 0;
+    return NULL;
+  }
+
+  *len = reader->len - reader->off;
+  return reader->data + reader->off;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param reader The given reader
+ * \param out Where to copy to, NULL to just skip
+ * \param len The number of bytes wanted
+ * \return The number of bytes read, less than \a len only at the end
+ *
+ * Reads across chunk boundaries, for the odd field split between two chunks
+ */
+size_t
+shim_buffer_reader_read(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  char* out, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len && shim_buffer_reader_load(reader)) {
+    size_t n = reader->len - reader->off;
+    if (n > len - done)
+      n = len - done;
+
+    if (out != NULL)
+      memcpy(out + done, reader->data + reader->off, n);
+
+    reader->off += n;
+    reader->remaining -= n;
+    done += n;
+  }
+
+  return done;
+}
+
+/**
+ * \param ctx Current executing context
+ * \param reader The given reader
+ * \param len The number of bytes to skip
+ * \return The number of bytes skipped
+ */
+size_t
+shim_buffer_reader_skip(shim_ctx_t* ctx, shim_buffer_reader_t* reader,
+  size_t len)
+{
+  return shim_buffer_reader_read(ctx, reader, NULL, len);
+}
+
+/**
+ * \param reader The given reader
+ * \return The number of bytes not yet read
+ */
+size_t
+shim_buffer_reader_remaining(shim_buffer_reader_t* reader)
+{
+  return reader->remaining;
+}
+
+/**
+ * \param reader The reader to free
+ */
+void
+shim_buffer_reader_free(shim_buffer_reader_t* reader)
+{
+  reader->chunks.Dispose();
+  delete reader;
+}
+
+void
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+external_weak_cb(Isolate* iso, Persistent<Value>* pobj,
+  external_baton_t* baton)
+{
+  Persistent<Value> obj = *pobj;
+#else
+external_weak_cb(Persistent<Value> obj, void* data)
+{
+  external_baton_t* baton = static_cast<external_baton_t*>(data);
+#endif
+  obj.Dispose();
+  shim_external_baton_free(baton);
+}
+
+
+/*
+ * Call cb(data, hint) once obj has been collected, size bytes are reported
+ * as external memory until then
+ */
+void
+shim_external_free_on_gc(shim_ctx_t* ctx, Local<Object> obj, char* data,
+  shim_buffer_free cb, void* hint, size_t size)
+{
+  external_baton_t* baton = new external_baton_t;
+  baton->cb = cb;
+  baton->data = data;
+  baton->hint = hint;
+  baton->size = size;
+
+  if (size > 0)
+    shim_external_adjust(static_cast<Isolate*>(ctx->isolate), size);
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  Persistent<Value> pobj = Persistent<Value>::New(
+    static_cast<Isolate*>(ctx->isolate), obj);
+#else
+  Persistent<Value> pobj = Persistent<Value>::New(obj);
+#endif
+  pobj.MakeWeak(baton, external_weak_cb);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param delta Bytes of native memory newly held (positive) or released
+ * (negative) on behalf of JS objects
+ * \return The total the VM now believes is held externally
+ *
+ * The collector uses this to decide when to run, so large native caches
+ * get collected on time instead of waiting for the JS heap to fill
+ */
+int64_t
+shim_adjust_external_memory(shim_ctx_t* ctx, int64_t delta)
+{
+  return shim_external_adjust(static_cast<Isolate*>(ctx->isolate), delta);
+}
+
+/**
+ * \param ctx The currently executing context
+ * \param obj The given object
+ * \param data The data to be associated with the object
+ * \param size The bytes of native memory \a data holds on to
+ * \return TRUE if the data was able to be associated, otherwise FALSE
+ *
+ * Like shim_obj_set_private(), but \a size is reported as external memory
+ * until the object is collected. For instances of a class made by
+ * shim_class_new() a later call replaces the size, otherwise each call adds
+ * to it.
+ */
+shim_bool_t
+shim_obj_set_private_sized(shim_ctx_t* ctx, shim_val_t* obj, void* data,
+  size_t size)
+{
+  if (!shim::shim_obj_set_private(ctx, obj, data))
+    return FALSE;
+
+  Local<Object> jsobj = OBJ_TO_OBJECT(SHIM_TO_VAL(obj));
+  struct shim_class_s* klass = shim_class_of(SHIM_STATE(ctx), jsobj);
+
+  /* the size is only given back if the instance's collection is seen */
+  if (klass == NULL) {
+    shim_external_free_on_gc(ctx, jsobj, NULL, NULL, NULL, size);
+    return TRUE;
+  }
+
+  if (size > 0)
+    shim_class_track(ctx, klass, obj);
+
+  size_t old = SHIM_FIELD_TO_SIZE(SHIM_GET_FIELD(jsobj,
+    SHIM_CLASS_FIELD_SIZE));
+  SHIM_SET_FIELD(jsobj, SHIM_CLASS_FIELD_SIZE, SHIM_FIELD_FROM_SIZE(size));
+  shim_external_adjust(static_cast<Isolate*>(ctx->isolate),
+    static_cast<int64_t>(size) - static_cast<int64_t>(old));
+
+  return TRUE;
+}
+
+
+shim_typedarray_type_t
+shim_typedarray_from_v8(v8::ExternalArrayType type)
+{
+  switch(type) {
+    case v8::kExternalByteArray:
+      return SHIM_TYPEDARRAY_INT8;
+    case v8::kExternalUnsignedByteArray:
+      return SHIM_TYPEDARRAY_UINT8;
+    case v8::kExternalPixelArray:
+      return SHIM_TYPEDARRAY_UINT8_CLAMPED;
+    case v8::kExternalShortArray:
+      return SHIM_TYPEDARRAY_INT16;
+    case v8::kExternalUnsignedShortArray:
+      return SHIM_TYPEDARRAY_UINT16;
+    case v8::kExternalIntArray:
+      return SHIM_TYPEDARRAY_INT32;
+    case v8::kExternalUnsignedIntArray:
+      return SHIM_TYPEDARRAY_UINT32;
+    case v8::kExternalFloatArray:
+      return SHIM_TYPEDARRAY_FLOAT32;
+    case v8::kExternalDoubleArray:
+      return SHIM_TYPEDARRAY_FLOAT64;
+    default:
+      return SHIM_TYPEDARRAY_UNKNOWN;
+  }
+}
+
+
+/**
+ * \param type The given element type
+ * \return The size in bytes of one element
+ */
+size_t
+shim_typedarray_element_size(shim_typedarray_type_t type)
+{
+  switch(type) {
+    case SHIM_TYPEDARRAY_INT8:
+    case SHIM_TYPEDARRAY_UINT8:
+    case SHIM_TYPEDARRAY_UINT8_CLAMPED:
+      return 1;
+    case SHIM_TYPEDARRAY_INT16:
+    case SHIM_TYPEDARRAY_UINT16:
+      return 2;
+    case SHIM_TYPEDARRAY_INT32:
+    case SHIM_TYPEDARRAY_UINT32:
+    case SHIM_TYPEDARRAY_FLOAT32:
+      return 4;
+    case SHIM_TYPEDARRAY_FLOAT64:
+      return 8;
+    case SHIM_TYPEDARRAY_UNKNOWN:
+    default:
+      return 0;
+  }
+}
+
+
+/**
+ * \param ctx Current executing context
+ * \param data Memory to be used for the ArrayBuffer
+ * \param len Size of the memory in bytes
+ * \param cb Callback that is called when the ArrayBuffer is to be freed
+ * \param hint Arbitrary data passed to the callback
+ * \return Wrapped ArrayBuffer, or NULL with an exception pending if this
+ * version of node doesn't support it
+ *
+ * The underlying memory is not copied, but used in place
+ */
+shim_val_t*
+shim_arraybuffer_new_external(shim_ctx_t* ctx, void* data, size_t len,
+  shim_buffer_free cb, void* hint)
+{
+#if SHIM_NATIVE_TYPED_ARRAYS
+  Local<v8::ArrayBuffer> ab = v8::ArrayBuffer::New(data, len);
+  shim_external_free_on_gc(ctx, ab, static_cast<char*>(data), cb, hint,
+    len);
+  return shim_val_alloc(ctx, ab, SHIM_TYPE_ARRAYBUFFER);
+#else
+  shim_throw_error(ctx, "External ArrayBuffers are not supported");
+  return NULL;
+#endif
+}
+
+
+/**
+ * \param ctx Current executing context
+ * \param type The element type of the array
+ * \param data Memory to be used for the elements
+ * \param len Number of elements in \a data
+ * \param cb Callback that is called when the array is to be freed
+ * \param hint Arbitrary data passed to the callback
+ * \return Wrapped typed array, or NULL with an exception pending if this
+ * version of node doesn't support it
+ *
+ * The underlying memory is not copied, but used in place
+ */
+shim_val_t*
+shim_typedarray_new_external(shim_ctx_t* ctx, shim_typedarray_type_t type,
+  void* data, size_t len, shim_buffer_free cb, void* hint)
+{
+#if SHIM_NATIVE_TYPED_ARRAYS
+  size_t size = shim_typedarray_element_size(type);
+
+  if (size == 0) {
+    shim_throw_type_error(ctx, "Unknown typed array type %d", type);
+    return NULL;
+  }
+
+  Local<v8::ArrayBuffer> ab = v8::ArrayBuffer::New(data, len * size);
+  Local<Value> view;
+
+  switch(type) {
+    case SHIM_TYPEDARRAY_INT8:
+      view = v8::Int8Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_UINT8:
+      view = v8::Uint8Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_UINT8_CLAMPED:
+      view = v8::Uint8ClampedArray::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_INT16:
+      view = v8::Int16Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_UINT16:
+      view = v8::Uint16Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_INT32:
+      view = v8::Int32Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_UINT32:
+      view = v8::Uint32Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_FLOAT32:
+      view = v8::Float32Array::New(ab, 0, len);
+      break;
+    case SHIM_TYPEDARRAY_FLOAT64:
+    default:
+      view = v8::Float64Array::New(ab, 0, len);
+      break;
+  }
+
+  /* views keep their buffer alive, so free once the buffer goes away */
+  shim_external_free_on_gc(ctx, ab, static_cast<char*>(data), cb, hint,
+    len * size);
+  return shim_val_alloc(ctx, view, SHIM_TYPE_TYPEDARRAY);
+#else
+  shim_throw_error(ctx, "External typed arrays are not supported");
+  return NULL;
+#endif
+}
+
+
+/**
+ * \param val The given typed array
+ * \param type Set to the element type of the array (may be NULL)
+ * \param len Set to the number of elements of the array (may be NULL)
+ * \return Pointer to the first element, or NULL if not a typed array
+ *
+ * The memory is used in place, it is valid as long as the array is alive
+ */
+void*
+shim_typedarray_data(shim_val_t* val, shim_typedarray_type_t* type,
+  size_t* len)
+{
+  Local<Value> v(SHIM_TO_VAL(val));
+
+  if (!v->IsObject())
+    return NULL;
+
+  Local<Object> obj = v.As<Object>();
+
+  if (!obj->HasIndexedPropertiesInExternalArrayData())
+    return NULL;
+
+  if (type != NULL)
+    *type = shim_typedarray_from_v8(
+      obj->GetIndexedPropertiesExternalArrayDataType());
+
+  if (len != NULL)
+    *len = obj->GetIndexedPropertiesExternalArrayDataLength();
+
+  return obj->GetIndexedPropertiesExternalArrayData();
+}
+
+
+/**
+ * \param val The given ArrayBuffer
+ * \param len Set to the size in bytes of the ArrayBuffer (may be NULL)
+ * \return Pointer to the memory, or NULL if not an ArrayBuffer
+ *
+ * The memory is used in place, it is valid as long as the ArrayBuffer is
+ * alive. The first call on an ArrayBuffer leaves a byte view of it in a
+ * hidden property, later calls read the memory through that view.
+ */
+void*
+shim_arraybuffer_data(shim_val_t* val, size_t* len)
+{
+  Local<Value> v(SHIM_TO_VAL(val));
+
+#if SHIM_NATIVE_TYPED_ARRAYS
+  if (!v->IsArrayBuffer())
+    return NULL;
+
+  /*
+   * this V8 has no ArrayBuffer::GetContents(), and Externalize() would hand
+   * freeing the memory to us, so the backing store is reached through a
+   * view. It is made once and kept on the buffer.
+   */
+  Local<v8::ArrayBuffer> ab = v.As<v8::ArrayBuffer>();
+  shim_isolate_s* state = shim_isolate_state(Isolate::GetCurrent());
+  Local<Value> cached = ab->GetHiddenValue(state->hidden_view);
+  Local<Object> view;
+
+  if (!cached.IsEmpty() && cached->IsObject()) {
+    view = cached.As<Object>();
+  } else {
+    view = v8::Uint8Array::New(ab, 0, ab->ByteLength());
+    ab->SetHiddenValue(state->hidden_view, view);
+  }
+#else
+  if (!v->IsObject())
+    return NULL;
+
+  Local<Object> view = v.As<Object>();
+#endif
+
+  if (!view->HasIndexedPropertiesInExternalArrayData())
+    return NULL;
+
+  if (len != NULL)
+    *len = view->GetIndexedPropertiesExternalArrayDataLength();
+
+  return view->GetIndexedPropertiesExternalArrayData();
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param data The external data to wrap
+ * \return Wrapped external
+ *
+ * This is an object that is safe to pass to and from JavaScript.
+ * \sa persistents
+ */
+shim_val_t*
+shim_external_new(shim_ctx_t* ctx, void* data)
+{
+  Local<Value> e;
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  e = External::New(data);
+#else
+  e = External::Wrap(data);
+#endif
+
+  return shim_val_alloc(ctx, e);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param obj The given external
+ * \return The pointer to the wrapped memory
+ */
+void*
+shim_external_value(shim_ctx_t* ctx, shim_val_t* obj)
+{
+  void* ret;
+  Local<External> e = SHIM_TO_VAL(obj).As<External>();
+
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+  ret = e->Value();
+#else
+  ret = External::Unwrap(e);
+#endif
+
+  return ret;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to be used for error
+ * \param ... Arguments for formatting
+ * \return The wrapped Error
+ */
+shim_val_t*
+shim_error_new(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_ERROR, msg, ap);
+  va_end(ap);
+  return shim_val_alloc(ctx, err);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to be used for error
+ * \param ... Arguments for formatting
+ * \return The wrapped TypeError
+ */
+shim_val_t*
+shim_error_type_new(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_TYPE, msg, ap);
+  va_end(ap);
+  return shim_val_alloc(ctx, err);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to be used for error
+ * \param ... Arguments for formatting
+ * \return The wrapped RangeError
+ */
+shim_val_t*
+shim_error_range_new(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_RANGE, msg, ap);
+  va_end(ap);
+  return shim_val_alloc(ctx, err);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \return TRUE if an exception is pending, otherwise FALSE
+ */
+shim_bool_t
+shim_exception_pending(shim_ctx_t* ctx)
+{
+  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
+  return trycatch->HasCaught();
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param val The error to use as the pending exception
+ */
+void
+shim_exception_set(shim_ctx_t* ctx, shim_val_t* val)
+{
+  ThrowException(SHIM_TO_VAL(val));
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param rval The currently pending exception
+ * \return TRUE if there was an exception, otherwise FALSE
+ */
+shim_bool_t
+shim_exception_get(shim_ctx_t* ctx, shim_val_t* rval)
+{
+  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
+  SHIM_VAL_SET(rval, *trycatch->Exception());
+  return TRUE;
+}
+
+/**
+ * \param ctx Currently executing context
+ */
+void
+shim_exception_clear(shim_ctx_t* ctx)
+{
+  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
+  trycatch->Reset();
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to set as the pending exception
+ * \param ... Arguments for formatting
+ */
+void
+shim_throw_error(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_ERROR, msg, ap));
+  va_end(ap);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to set as the pending exception
+ * \param ... Arguments for formatting
+ */
+void
+shim_throw_type_error(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_TYPE, msg, ap));
+  va_end(ap);
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param msg The message to set as the pending exception
+ * \param ... Arguments for formatting
+ */
+void
+shim_throw_range_error(shim_ctx_t* ctx, const char* msg, ...)
+{
+  va_list ap;
+  va_start(ap, msg);
+  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_RANGE, msg, ap));
+  va_end(ap);
+}
+
+
+/* build an error from the interned strings, optionally without a stack */
+Local<Value>
+shim_error_desc_make(const shim_error_desc_t* desc, shim_error_cache_s* cache,
+  bool nostack)
+{
+  Local<Object> ctor;
+  Local<Value> limit;
+  Local<String> limit_name;
+  bool had_limit = false;
+
+  if (nostack) {
+    /*
+     * stack frames are captured as the error is constructed. Script may
+     * have replaced Error or put a throwing accessor on it, then the stack
+     * is captured as usual and nothing is left pending.
+     */
+    TryCatch trycatch;
+    limit_name = String::NewSymbol("stackTraceLimit");
+    Local<Value> global_error = v8::Context::GetCurrent()->Global()
+      ->Get(String::NewSymbol("Error"));
+
+    if (!trycatch.HasCaught() && global_error->IsObject()) {
+      Local<Object> obj = global_error.As<Object>();
+      had_limit = obj->Has(limit_name);
+      limit = obj->Get(limit_name);
+
+      if (!trycatch.HasCaught())
+        obj->Set(limit_name, Integer::New(0));
+
+      if (!trycatch.HasCaught())
+        ctor = obj;
+    }
+  }
+
+  Local<Value> err = shim_error_make(desc->kind, ATOM_TO_STR(cache->message));
+
+  /* an absent limit is deleted again, an own undefined disables stacks */
+  if (!ctor.IsEmpty()) {
+    TryCatch trycatch;
+    if (had_limit)
+      ctor->Set(limit_name, limit);
+    else
+      ctor->Delete(limit_name);
+  }
+
+  if (cache->code != NULL)
+    err.As<Object>()->Set(String::NewSymbol("code"), ATOM_TO_STR(cache->code));
+
+  return err;
+}
+
+
+shim_error_cache_s*
+shim_error_desc_cache(shim_ctx_t* ctx, const shim_error_desc_t* desc)
+{
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  shim_error_cache_s** bucket = &SHIM_STATE(ctx)->errors[
+    (reinterpret_cast<uintptr_t>(desc) >> 4) & (SHIM_ERRORS_SIZE - 1)];
+  shim_error_cache_s* cache;
+
+  for (cache = *bucket; cache != NULL; cache = cache->next)
+    if (cache->desc == desc)
+      return cache;
+
+  cache = new shim_error_cache_s;
+  cache->desc = desc;
+  cache->message = shim_atom_new(ctx, desc->message);
+  cache->code = desc->code != NULL ? shim_atom_new(ctx, desc->code) : NULL;
+
+  if (desc->flags & SHIM_ERROR_NOSTACK) {
+    Local<Value> err = shim_error_desc_make(desc, cache, true);
+#if NODE_VERSION_AT_LEAST(0, 11, 3)
+    cache->error = Persistent<Value>::New(isolate, err);
+#else
+    cache->error = Persistent<Value>::New(err);
+#endif
+  }
+
+  cache->next = *bucket;
+  *bucket = cache;
+  return cache;
+}
+
+
+/**
+ * \param ctx Currently executing context
+ * \param desc The descriptor of the error
+ * \return The wrapped error
+ *
+ * A SHIM_ERROR_NOSTACK descriptor returns the same object every time, so
+ * anything set on it is seen by every later catch
+ */
+shim_val_t*
+shim_error_desc_new(shim_ctx_t* ctx, const shim_error_desc_t* desc)
+{
+  shim_error_cache_s* cache = shim_error_desc_cache(ctx, desc);
+
+  if (desc->flags & SHIM_ERROR_NOSTACK)
+    return shim_val_alloc(ctx, Local<Value>(*cache->error));
+
+  return shim_val_alloc(ctx, shim_error_desc_make(desc, cache, false));
+}
+
+
+/**
+ * \param ctx Currently executing context
+ * \param desc The descriptor of the error to set as the pending exception
+ *
+ * Meant for errors that are thrown often and expected, like rejected input
+ */
+void
+shim_throw_desc(shim_ctx_t* ctx, const shim_error_desc_t* desc)
+{
+  shim_error_cache_s* cache = shim_error_desc_cache(ctx, desc);
+
+  if (desc->flags & SHIM_ERROR_NOSTACK)
+    ThrowException(Local<Value>(*cache->error));
+  else
+    ThrowException(shim_error_desc_make(desc, cache, false));
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param arg Given wrapped value
+ * \param type The destination type
+ * \param rval The pointer to where the data will be stored
+ * \return TRUE if it was able to convert, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_type(shim_ctx_t* ctx, shim_val_t* arg, shim_type_t type,
+  void* rval)
+{
+  if (!shim::shim_value_is(arg, type))
+    return FALSE;
+
+  if (SHIM_VAL_UNBOXED(arg)) {
+    switch(type) {
+      case SHIM_TYPE_NUMBER:
+        *(double*)rval = arg->num;
+        return TRUE;
+      case SHIM_TYPE_INT32:
+        *(int32_t*)rval = static_cast<int32_t>(arg->num);
+        return TRUE;
+      case SHIM_TYPE_UINT32:
+        *(uint32_t*)rval = static_cast<uint32_t>(arg->num);
+        return TRUE;
+      case SHIM_TYPE_INTEGER:
+        if (arg->type == SHIM_TYPE_INT32) {
+          *(int64_t*)rval = static_cast<int64_t>(arg->num);
+          return TRUE;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  Local<Value> val(SHIM_TO_VAL(arg));
+  switch(type) {
+    case SHIM_TYPE_BOOL:
+      *(shim_bool_t*)rval = val->BooleanValue();
+      break;
+    case SHIM_TYPE_INTEGER:
+      *(int64_t*)rval = val->IntegerValue();
+      break;
+    case SHIM_TYPE_UINT32:
+      *(uint32_t*)rval = val->Uint32Value();
+      break;
+    case SHIM_TYPE_INT32:
+      *(int32_t*)rval = val->Int32Value();
+      break;
+    case SHIM_TYPE_NUMBER:
+      *(double*)rval = val->NumberValue();
+      break;
+    case SHIM_TYPE_EXTERNAL:
+      *(void**)rval = shim::shim_external_value(ctx, arg);
+      break;
+    case SHIM_TYPE_BUFFER:
+      *(char**)rval = shim::shim_buffer_value(arg);
+      break;
+    case SHIM_TYPE_TYPEDARRAY:
+      *(void**)rval = shim::shim_typedarray_data(arg, NULL, NULL);
+      break;
+    case SHIM_TYPE_ARRAYBUFFER:
+      *(void**)rval = shim::shim_arraybuffer_data(arg, NULL);
+      break;
+    case SHIM_TYPE_STRING:
+      SHIM_VAL_SET(*(shim_val_t**)rval, *OBJ_TO_STRING(val));
+      break;
+    case SHIM_TYPE_UNDEFINED:
+    case SHIM_TYPE_NULL:
+    case SHIM_TYPE_DATE:
+    case SHIM_TYPE_ARRAY:
+    case SHIM_TYPE_OBJECT:
+    case SHIM_TYPE_FUNCTION:
+    default:
+      return FALSE;
+      break;
+  }
+
+  return TRUE;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param args Arguments passed to the function
+ * \param idx Index of the argument to unpack
+ * \param type The destination type
+ * \param rval The pointer to the destination
+ * \return TRUE if it was able to unpack, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_one(shim_ctx_t* ctx, shim_args_t* args, uint32_t idx,
+  shim_type_t type, void* rval)
+{
+  shim_val_t* arg = args->argv[idx];
+  return shim::shim_unpack_type(ctx, arg, type, rval);
+}
+
+/*
+ * Each of these is a type check followed by a conversion and never throws,
+ * so a caller that knows the type it wants skips shim_unpack_type() and its
+ * dispatch on type. Numbers that were unboxed when the argument was
+ * classified need neither.
+ */
+
+/**
+ * \param val The given value
+ * \param out Set to the value if it is an int32
+ * \return TRUE if the value was converted, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_int32(shim_val_t* val, int32_t* out)
+{
+  if (SHIM_VAL_UNBOXED(val)) {
+    if (!shim_num_is_int32(val->num))
+      return FALSE;
+    *out = static_cast<int32_t>(val->num);
+    return TRUE;
+  }
+
+  Local<Value> v = shim_val_handle(val);
+  if (!v->IsInt32())
+    return FALSE;
+  *out = v->Int32Value();
+  return TRUE;
+}
+
+/**
+ * \param val The given value
+ * \param out Set to the value if it is a uint32
+ * \return TRUE if the value was converted, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_uint32(shim_val_t* val, uint32_t* out)
+{
+  if (SHIM_VAL_UNBOXED(val)) {
+    if (!shim_num_is_uint32(val->num))
+      return FALSE;
+    *out = static_cast<uint32_t>(val->num);
+    return TRUE;
+  }
+
+  Local<Value> v = shim_val_handle(val);
+  if (!v->IsUint32())
+    return FALSE;
+  *out = v->Uint32Value();
+  return TRUE;
+}
+
+/**
+ * \param val The given value
+ * \param out Set to the integer part of the value if it is a number
+ * \return TRUE if the value was converted, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_int64(shim_val_t* val, int64_t* out)
+{
+  if (SHIM_VAL_UNBOXED(val)) {
+    *out = shim_num_to_int64(val->num);
+    return TRUE;
+  }
+
+  Local<Value> v = shim_val_handle(val);
+  if (!v->IsNumber())
+    return FALSE;
+  *out = v->IntegerValue();
+  return TRUE;
+}
+
+/**
+ * \param val The given value
+ * \param out Set to the value if it is a number
+ * \return TRUE if the value was converted, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_double(shim_val_t* val, double* out)
+{
+  if (SHIM_VAL_UNBOXED(val)) {
+    *out = val->num;
+    return TRUE;
+  }
+
+  Local<Value> v = shim_val_handle(val);
+  if (!v->IsNumber())
+    return FALSE;
+  *out = v->NumberValue();
+  return TRUE;
+}
+
+/**
+ * \param val The given value
+ * \param out Set to the value if it is a boolean
+ * \return TRUE if the value was converted, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_bool(shim_val_t* val, shim_bool_t* out)
+{
+  if ((val->flags & SHIM_VAL_EXACT) && val->type != SHIM_TYPE_BOOL)
+    return FALSE;
+
+  Local<Value> v = shim_val_handle(val);
+  if (!v->IsBoolean())
+    return FALSE;
+  *out = v->BooleanValue();
+  return TRUE;
+}
+
+/**
+ * \param val The given value
+ * \param data Set to the memory of the Buffer
+ * \param len Set to the length of the Buffer
+ * \return TRUE if the value is a Buffer, otherwise FALSE
+ */
+shim_bool_t
+shim_unpack_buffer(shim_val_t* val, char** data, size_t* len)
+{
+  Local<Value> v = shim_val_handle(val);
+  if (!node::Buffer::HasInstance(v))
+    return FALSE;
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+  *data = node::Buffer::Data(v);
+  *len = node::Buffer::Length(v);
+#else
+  *data = node::Buffer::Data(v.As<Object>());
+  *len = node::Buffer::Length(v.As<Object>());
+#endif
+  return TRUE;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param args Arguments passed to the function
+ * \param type The first type to unpack
+ * \return TRUE if all desired arguments were able to be unpacked, otherwise
+ * FALSE
+ *
+ * Arguments are passed in pairs of shim_type_t and a pointer to their
+ * destination, you end the set of pairs by a single SHIM_TYPE_UNKNOWN.
+ *
+ * In the event an argument was unable to be unpacked, FALSE is returned and
+ * an exception is set.
+ */
+shim_bool_t
+shim_unpack(shim_ctx_t* ctx, shim_args_t* args, shim_type_t type, ...)
+{
+  size_t cur;
+  shim_type_t ctype = type;
+  va_list ap;
+
+  va_start(ap, type);
+
+  for (cur = 0, ctype = type; ctype != SHIM_TYPE_UNKNOWN && cur < args->argc; cur++)
+  {
+    void* rval = va_arg(ap, void*);
+
+    if(!shim::shim_unpack_one(ctx, args, cur, ctype, rval)) {
+      /* TODO this should use a type string */
+      shim::shim_throw_type_error(ctx, "Argument %d not of type %s", cur,
+        shim_type_str(ctype));
+      return FALSE;
+    }
+
+    ctype = static_cast<shim_type_t>(va_arg(ap, int));
+  }
+
+  va_end(ap);
+
+  return TRUE;
+}
+
+/**
+ * \param args The arguments passed to the function
+ * \return The amount of arguments passed to the function
+ */
+size_t
+shim_args_length(shim_args_t* args)
+{
+  return args->argc;
+}
+
+/**
+ * \param args The arguments passed to the function
+ * \param idx The index of the desired argument
+ * \return The wrapped argument
+ */
+shim_val_t*
+shim_args_get(shim_args_t* args, size_t idx)
+{
+  /* TODO assert */
+  return args->argv[idx];
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param args The arguments passed to the function
+ * \param val The value to use for return
+ * \return TRUE if it was able to set the return value, otherwise FALSE
+ */
+shim_bool_t
+shim_args_set_rval(shim_ctx_t* ctx, shim_args_t* args, shim_val_t* val)
+{
+  /* TODO check if persistent */
+  /*
+  if (!shim_has_allocd(ctx, val))
+    allocs_from_ctx(ctx)->insert(val);
+  */
+  args->ret = val;
+  return TRUE;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param args The arguments passed to the function
+ * \return The `this` associated with the executing function
+ */
+shim_val_t*
+shim_args_get_this(shim_ctx_t* ctx, shim_args_t* args)
+{
+  return args->self;
+}
+
+/**
+ * \param ctx Currently executing context
+ * \param args The arguments passed to the function
+ * \return Pointer to the arbitrary data associated with the executing function
+ */
+void*
+shim_args_get_data(shim_ctx_t* ctx, shim_args_t* args)
+{
+  return args->data;
+}
+
+
+/*
+ * The queues of work requests are kept per isolate, and only touched on
+ * that isolate's thread
+ */
+#define SHIM_WORK_POOL_MAX 1024
+
+
+shim_work_t*
+shim_work_alloc(shim_isolate_s* state, shim_work_cb work_cb,
+  shim_after_work after_cb, void* hint)
+{
+  shim_work_t* work;
+
+  if (!QUEUE_EMPTY(&state->work_free)) {
+    QUEUE* q = QUEUE_HEAD(&state->work_free);
+    QUEUE_REMOVE(q);
+    state->work_free_count--;
+    work = QUEUE_DATA(q, shim_work_t, queue);
+  } else {
+    work = new shim_work_t;
+  }
+
+  work->req.data = work;
+  work->state = state;
+  work->work_cb = work_cb;
+  work->after_cb = after_cb;
+  work->hint = hint;
+  work->batch = NULL;
+  work->index = 0;
+  work->remaining = 0;
+  work->status = 0;
+  work->cancelled = FALSE;
+  work->submitted = FALSE;
+  work->progress = 0;
+  work->pool = NULL;
+  work->resolve_cb = NULL;
+  work->resolver = 0;
+  QUEUE_INIT(&work->members);
+  work->queued_at = stats_flags & SHIM_STATS_COUNT ? uv_hrtime() : 0;
+  return work;
+}
+
+
+void
+shim_work_release(shim_work_t* work)
+{
+  shim_isolate_s* state = work->state;
+
+  if (state->work_free_count < SHIM_WORK_POOL_MAX) {
+    QUEUE_INSERT_HEAD(&state->work_free, &work->queue);
+    state->work_free_count++;
+  } else {
+    delete work;
+  }
+}
+
+
+void before_work(uv_work_t* req);
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+void before_after(uv_work_t* req, int status);
+#else
+void before_after(uv_work_t* req);
+#endif
+
+
+void
+shim_work_submit(shim_work_t* work)
+{
+  shim_isolate_s* state = work->state;
+
+  if (state->work_limit > 0 && state->work_inflight >= state->work_limit) {
+    QUEUE_INSERT_TAIL(&state->work_pending, &work->queue);
+    state->work_pending_count++;
+    return;
+  }
+
+  state->work_inflight++;
+  work->submitted = TRUE;
+  uv_queue_work(state->loop, &work->req, before_work, before_after);
+
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+  /* cancelled while it waited for the in flight limit */
+  if (shim_work_cancelled(work))
+    uv_cancel(reinterpret_cast<uv_req_t*>(&work->req));
 #endif
 }
 
-/**
- * \param val The given buffer
- * \return THe size of the buffer
- */
-size_t
-shim_buffer_length(shim_val_t* val)
+
+void
+shim_work_drain(shim_isolate_s* state)
+{
+  while (!QUEUE_EMPTY(&state->work_pending)
+      && (state->work_limit == 0
+        || state->work_inflight < state->work_limit)) {
+    QUEUE* q = QUEUE_HEAD(&state->work_pending);
+    QUEUE_REMOVE(q);
+    state->work_pending_count--;
+    shim_work_submit(QUEUE_DATA(q, shim_work_t, queue));
+  }
+}
+
+
+void
+before_work(uv_work_t* req)
+{
+  shim_work_t* work = static_cast<shim_work_t*>(req->data);
+
+  /* the head of an empty batch has nothing to run */
+  if (work->work_cb != NULL && !shim_work_cancelled(work))
+    work->work_cb(work, work->hint);
+}
+
+
+void
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+before_after(uv_work_t* req, int status)
 {
-  Local<Value>v(SHIM_TO_VAL(val));
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  assert(node::Buffer::HasInstance(v));
-  return node::Buffer::Length(v);
-#elif NODE_VERSION_AT_LEAST(0, 10, 0)
-  assert(Buffer::HasInstance(v));
-  return Buffer::Length(v);
 #else
-  assert(Buffer::HasInstance(v));
-  return Buffer::Length(v.As<Object>());
+before_after(uv_work_t* req)
+{
+  int status = 0;
 #endif
+  shim_work_t* work = static_cast<shim_work_t*>(req->data);
+
+  work->state->work_inflight--;
+  shim_work_drain(work->state);
+
+  /* members of a batch report to their head, only the last one calls out */
+  if (work->batch != NULL) {
+    shim_work_t* head = work->batch;
+
+    if (status != 0 && head->status == 0)
+      head->status = status;
+
+    QUEUE_REMOVE(&work->members);
+    shim_work_release(work);
+
+    if (--head->remaining > 0)
+      return;
+
+    work = head;
+    status = head->status;
+  }
+
+  if (work->cancelled)
+    status = SHIM_WORK_CANCELED;
+
+  if (work->queued_at != 0)
+    SHIM_STATS(shim_stats_latency(work->queued_at));
+
+  SHIM_PROLOGUE(ctx);
+  work->after_cb(&ctx, work, status, work->hint);
+  shim_context_cleanup(&ctx);
+  shim_work_release(work);
+
+  /* nothing called us, so what after_cb threw is uncaught */
+  if (ctx_trycatch.HasCaught())
+    node::FatalException(ctx_trycatch);
+}
+
+/**
+ * \param work_cb Callback that will be called on a different thread
+ * \param after_cb Callback that will be called on the main thread
+ * \param hint Arbitrary data to be passed to both callbacks
+ * \return The job, valid until \a after_cb returns
+ */
+shim_work_t*
+shim_queue_work(shim_work_cb work_cb, shim_after_work after_cb, void* hint)
+{
+  shim_work_t* work = shim_work_alloc(
+    shim_isolate_state(Isolate::GetCurrent()), work_cb, after_cb, hint);
+  shim_work_submit(work);
+  return work;
+}
+
+#if SHIM_PROMISES
+/* called with the resolver, whether to resolve it, and the value */
+void
+shim_promise_settle(const FunctionCallbackInfo<Value>& info)
+{
+  Local<v8::Promise::Resolver> resolver =
+    info[0].As<v8::Promise::Resolver>();
+
+  if (info[1]->IsTrue())
+    resolver->Resolve(info[2]);
+  else
+    resolver->Reject(info[2]);
+}
+
+
+/* settle the promise of a job with what its resolve_cb made of the result */
+void
+shim_promise_after(shim_ctx_t* ctx, shim_work_t* work, int status, void* hint)
+{
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
+  shim_isolate_s* state = SHIM_STATE(ctx);
+  shim_handle_table_t* promises = state->promises;
+  shim_val_t* rval = NULL;
+
+  shim_bool_t ok = work->resolve_cb(ctx, work, status, hint, &rval);
+
+  Local<Value> result;
+  if (trycatch->HasCaught()) {
+    result = trycatch->Exception();
+    trycatch->Reset();
+    ok = FALSE;
+  } else {
+    result = shim_val_handle(rval != NULL ? rval : shim_undefined());
+  }
+
+  shim_val_t* resolver = shim_handle_table_get(ctx, promises, work->resolver);
+  shim_handle_table_remove(promises, work->resolver);
+
+  if (state->promise_settle.IsEmpty())
+    state->promise_settle = Persistent<Function>::New(isolate,
+      Function::New(isolate, shim_promise_settle));
+
+  /*
+   * Going through MakeCallback lets node run the reactions along with the
+   * nextTick queue, in its order, the way it does for its own callbacks
+   */
+  Local<Value> argv[] = {
+    SHIM_TO_VAL(resolver),
+    Boolean::New(ok != FALSE),
+    result,
+  };
+  node::MakeCallback(v8::Context::GetCurrent()->Global(),
+    Local<Function>(*state->promise_settle), 3, argv);
 }
+#endif
 
 /**
  * \param ctx Currently executing context
- * \param data The external data to wrap
- * \return Wrapped external
+ * \param work_cb Callback that will be called on a different thread
+ * \param resolve_cb Callback on the main thread that decides how the promise
+ * is settled
+ * \param hint Arbitrary data to be passed to both callbacks
+ * \return The promise of the job, or NULL with an exception pending when
+ * this node has no promises
  *
- * This is an object that is safe to pass to and from JavaScript.
- * \sa persistents
+ * Resolvers are kept in a handle table of the isolate, so a job needs no
+ * callback of its own and its persistent lives in a slot that is reused
+ * rather than allocated
  */
 shim_val_t*
-shim_external_new(shim_ctx_t* ctx, void* data)
+shim_queue_work_promise(shim_ctx_t* ctx, shim_work_cb work_cb,
+  shim_resolve_cb resolve_cb, void* hint)
 {
-  Local<Value> e;
+#if SHIM_PROMISES
+  Isolate* isolate = static_cast<Isolate*>(ctx->isolate);
+  shim_isolate_s* state = SHIM_STATE(ctx);
 
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  e = External::New(data);
+  if (state->promises == NULL)
+    state->promises = shim_handle_table_new();
+
+  Local<v8::Promise::Resolver> jsresolver = v8::Promise::Resolver::New(isolate);
+  shim_val_t resolver;
+  shim_val_init(&resolver, jsresolver);
+
+  shim_work_t* work = shim_work_alloc(state, work_cb, shim_promise_after,
+    hint);
+  work->resolve_cb = resolve_cb;
+  work->resolver = shim_handle_table_add(ctx, state->promises, &resolver);
+  shim_work_submit(work);
+
+  return shim_val_alloc(ctx, jsresolver->GetPromise(), SHIM_TYPE_OBJECT);
 #else
-  e = External::Wrap(data);
+  shim_throw_error(ctx, "Promises need node v0.11.14 or later");
+  return NULL;
 #endif
+}
 
-  return shim_val_alloc(ctx, e);
+/**
+ * \param work_cbs Callbacks that will each be called on a different thread
+ * \param n The number of entries in \a work_cbs
+ * \param after_cb Callback that will be called on the main thread once all
+ * of the jobs have finished
+ * \param hint Arbitrary data to be passed to all callbacks
+ *
+ * The jobs run in parallel, shim_work_index() tells a job its position in
+ * \a work_cbs. \a after_cb is called only once, with the first non zero
+ * status if any job failed. An empty batch still calls \a after_cb from the
+ * loop, never from inside this call.
+ * \return The head of the batch, valid until \a after_cb returns
+ */
+shim_work_t*
+shim_queue_work_batch(shim_work_cb* work_cbs, size_t n,
+  shim_after_work after_cb, void* hint)
+{
+  shim_isolate_s* state = shim_isolate_state(Isolate::GetCurrent());
+  shim_work_t* head = shim_work_alloc(state, NULL, after_cb, hint);
+  head->remaining = n;
+
+  /* the head goes through the pool alone, as a job with nothing to run */
+  if (n == 0) {
+    shim_work_submit(head);
+    return head;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    shim_work_t* work = shim_work_alloc(state, work_cbs[i], NULL, hint);
+    work->batch = head;
+    work->index = i;
+    QUEUE_INSERT_TAIL(&head->members, &work->members);
+    shim_work_submit(work);
+  }
+
+  return head;
 }
 
 /**
- * \param ctx Currently executing context
- * \param obj The given external
- * \return The pointer to the wrapped memory
+ * \param work The given job
+ * \return The position of the job in its batch, 0 for single jobs
  */
-void*
-shim_external_value(shim_ctx_t* ctx, shim_val_t* obj)
+size_t
+shim_work_index(shim_work_t* work)
 {
-  void* ret;
-  Local<External> e = SHIM_TO_VAL(obj).As<External>();
+  return work->index;
+}
 
-#if NODE_VERSION_AT_LEAST(0, 11, 3)
-  ret = e->Value();
-#else
-  ret = External::Unwrap(e);
+/**
+ * \param work The job, or the head of a batch, to cancel
+ *
+ * Jobs still waiting for a thread are never started, for a batch that is
+ * every member not yet started. Jobs already running have to poll
+ * shim_work_cancelled() and return early. Either way the after callback
+ * still runs, with a status of ::SHIM_WORK_CANCELED.
+ */
+void
+shim_work_cancel(shim_work_t* work)
+{
+  work->cancelled = TRUE;
+  __sync_synchronize();
+
+#if NODE_VERSION_AT_LEAST(0, 10, 0)
+  if (work->submitted)
+    uv_cancel(reinterpret_cast<uv_req_t*>(&work->req));
+
+  /* libuv only reports the cancellation later, so the list stays intact */
+  QUEUE* q;
+  QUEUE_FOREACH(q, &work->members) {
+    shim_work_t* member = QUEUE_DATA(q, shim_work_t, members);
+    if (member->submitted)
+      uv_cancel(reinterpret_cast<uv_req_t*>(&member->req));
+  }
 #endif
+}
 
-  return ret;
+/**
+ * \param work The given job
+ * \return TRUE if the job or its batch has been cancelled
+ */
+shim_bool_t
+shim_work_cancelled(shim_work_t* work)
+{
+  if (work->batch != NULL && work->batch->cancelled)
+    return TRUE;
+  return work->cancelled ? TRUE : FALSE;
 }
 
 /**
- * \param ctx Currently executing context
- * \param msg The message to be used for error
- * \param ... Arguments for formatting
- * \return The wrapped Error
+ * \param work The given job
+ * \param progress Any measure of progress the job chooses
+ *
+ * Meant to be called from the work callback, the value is stored without
+ * locking so the main thread can sample it cheaply
  */
-shim_val_t*
-shim_error_new(shim_ctx_t* ctx, const char* msg, ...)
+void
+shim_work_progress_set(shim_work_t* work, size_t progress)
 {
-  va_list ap;
-  va_start(ap, msg);
-  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_ERROR, msg, ap);
-  va_end(ap);
-  return shim_val_alloc(ctx, err);
+  work->progress = progress;
 }
 
 /**
- * \param ctx Currently executing context
- * \param msg The message to be used for error
- * \param ... Arguments for formatting
- * \return The wrapped TypeError
+ * \param work The given job
+ * \return The last progress reported by the job, 0 if none
  */
-shim_val_t*
-shim_error_type_new(shim_ctx_t* ctx, const char* msg, ...)
+size_t
+shim_work_progress(shim_work_t* work)
 {
-  va_list ap;
-  va_start(ap, msg);
-  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_TYPE, msg, ap);
-  va_end(ap);
-  return shim_val_alloc(ctx, err);
+  return work->progress;
 }
 
 /**
- * \param ctx Currently executing context
- * \param msg The message to be used for error
- * \param ... Arguments for formatting
- * \return The wrapped RangeError
+ * \param limit The most jobs to hand to the threadpool at once, 0 for no
+ * limit
+ *
+ * Jobs queued past the limit wait on the main thread and are submitted as
+ * earlier ones complete, so bursts don't flood the threadpool. The limit
+ * applies to the jobs of the current isolate only.
  */
-shim_val_t*
-shim_error_range_new(shim_ctx_t* ctx, const char* msg, ...)
+void
+shim_queue_work_set_limit(size_t limit)
 {
-  va_list ap;
-  va_start(ap, msg);
-  Local<Value> err = shim::shim_format_error(ctx, SHIM_ERR_RANGE, msg, ap);
-  va_end(ap);
-  return shim_val_alloc(ctx, err);
+  shim_isolate_s* state = shim_isolate_state(Isolate::GetCurrent());
+  state->work_limit = limit;
+  shim_work_drain(state);
 }
 
 /**
- * \param ctx Currently executing context
- * \return TRUE if an exception is pending, otherwise FALSE
+ * \return The number of the current isolate's jobs waiting for the in
+ * flight limit
+ */
+size_t
+shim_queue_work_pending()
+{
+  return shim_isolate_state(Isolate::GetCurrent())->work_pending_count;
+}
+
+/*
+ * Lock free stack that any thread may push to, the main thread takes the
+ * whole list at once and gets it back in the order it was pushed. Returns
+ * TRUE if the list was empty before this push.
  */
 shim_bool_t
-shim_exception_pending(shim_ctx_t* ctx)
+shim_mpsc_push(shim_mpsc_node_t* volatile* head, shim_mpsc_node_t* node)
 {
-  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
-  return trycatch->HasCaught();
+  shim_mpsc_node_t* old;
+
+  do {
+    old = *head;
+    node->next = old;
+  } while (!__sync_bool_compare_and_swap(head, old, node));
+
+  return old == NULL;
+}
+
+
+shim_mpsc_node_t*
+shim_mpsc_take(shim_mpsc_node_t* volatile* head)
+{
+  shim_mpsc_node_t* cur = __sync_lock_test_and_set(head, NULL);
+  shim_mpsc_node_t* prev = NULL;
+
+  while (cur != NULL) {
+    shim_mpsc_node_t* next = cur->next;
+    cur->next = prev;
+    prev = cur;
+    cur = next;
+  }
+
+  return prev;
+}
+
+
+/* the oldest job of one priority, jobs come from the main thread in order */
+shim_work_t*
+shim_worker_pop(shim_worker_t* worker, int priority)
+{
+  shim_work_t* work = NULL;
+  QUEUE* jobs = &worker->jobs[priority];
+
+  uv_mutex_lock(&worker->lock);
+
+  if (!QUEUE_EMPTY(jobs)) {
+    QUEUE* q = QUEUE_HEAD(jobs);
+    QUEUE_REMOVE(q);
+    work = QUEUE_DATA(q, shim_work_t, queue);
+  }
+
+  uv_mutex_unlock(&worker->lock);
+  return work;
+}
+
+
+/* every worker's high priority jobs go before any normal one, own first */
+shim_work_t*
+shim_worker_next(shim_worker_t* worker)
+{
+  shim_pool_t* pool = worker->pool;
+  size_t self = worker - pool->workers;
+  shim_work_t* work = NULL;
+
+  for (int p = 0; work == NULL && p < SHIM_PRIORITY_COUNT; p++) {
+    for (size_t i = 0; work == NULL && i < pool->nworkers; i++) {
+      size_t victim = (self + i) % pool->nworkers;
+      work = shim_worker_pop(&pool->workers[victim], p);
+    }
+  }
+
+  if (work != NULL)
+    __sync_fetch_and_sub(&pool->queued, 1);
+
+  return work;
+}
+
+
+void
+shim_worker_run(void* arg)
+{
+  shim_worker_t* worker = static_cast<shim_worker_t*>(arg);
+  shim_pool_t* pool = worker->pool;
+
+  for (;;) {
+    shim_work_t* work = shim_worker_next(worker);
+
+    if (work != NULL) {
+      if (!shim::shim_work_cancelled(work))
+        work->work_cb(work, work->hint);
+      if (shim_mpsc_push(&pool->done, &work->done))
+        uv_async_send(&pool->async);
+      continue;
+    }
+
+    uv_mutex_lock(&pool->lock);
+    while (pool->queued == 0 && !pool->stopping)
+      uv_cond_wait(&pool->cond, &pool->lock);
+    shim_bool_t stop = pool->stopping && pool->queued == 0;
+    uv_mutex_unlock(&pool->lock);
+
+    if (stop)
+      break;
+  }
+}
+
+
+SHIM_ASYNC_CB(shim_pool_complete, handle)
+{
+  shim_pool_t* pool = container_of(handle, shim_pool_t, async);
+  shim_mpsc_node_t* node = shim_mpsc_take(&pool->done);
+
+  while (node != NULL) {
+    shim_work_t* work = container_of(node, shim_work_t, done);
+    node = node->next;
+
+    if (--pool->inflight == 0)
+      uv_unref(reinterpret_cast<uv_handle_t*>(&pool->async));
+
+    int status = work->cancelled ? SHIM_WORK_CANCELED : 0;
+
+    if (work->queued_at != 0)
+      SHIM_STATS(shim_stats_latency(work->queued_at));
+
+    SHIM_PROLOGUE(ctx);
+    work->after_cb(&ctx, work, status, work->hint);
+    shim_context_cleanup(&ctx);
+    shim_work_release(work);
+
+    /* nothing called us, so what after_cb threw is uncaught */
+    if (ctx_trycatch.HasCaught())
+      node::FatalException(ctx_trycatch);
+  }
+}
+
+
+void
+shim_pool_close_cb(uv_handle_t* handle)
+{
+  shim_pool_t* pool = container_of(handle, shim_pool_t, async);
+  delete[] pool->workers;
+  delete pool;
 }
 
 /**
- * \param ctx Currently executing context
- * \param val The error to use as the pending exception
+ * \param nthreads The number of worker threads, at least one is started
+ * \return The created pool
+ *
+ * Jobs queued with shim_pool_queue_work() run on these threads instead of
+ * the libuv threadpool, so they neither starve nor are starved by file
+ * system and dns requests. Completions are delivered to the main thread in
+ * batches through a single async handle.
  */
-void
-shim_exception_set(shim_ctx_t* ctx, shim_val_t* val)
+shim_pool_t*
+shim_pool_new(size_t nthreads)
 {
-  ThrowException(SHIM_TO_VAL(val));
+  if (nthreads == 0)
+    nthreads = 1;
+
+  shim_isolate_s* state = shim_isolate_state(Isolate::GetCurrent());
+
+  shim_pool_t* pool = new shim_pool_t;
+  pool->queued = 0;
+  pool->inflight = 0;
+  pool->next = 0;
+  pool->stopping = FALSE;
+  pool->done = NULL;
+  pool->nworkers = nthreads;
+  pool->workers = new shim_worker_t[nthreads];
+
+  uv_mutex_init(&pool->lock);
+  uv_cond_init(&pool->cond);
+  uv_async_init(state->loop, &pool->async, shim_pool_complete);
+  uv_unref(reinterpret_cast<uv_handle_t*>(&pool->async));
+
+  for (size_t i = 0; i < nthreads; i++) {
+    shim_worker_t* worker = &pool->workers[i];
+    worker->pool = pool;
+    uv_mutex_init(&worker->lock);
+    for (int p = 0; p < SHIM_PRIORITY_COUNT; p++)
+      QUEUE_INIT(&worker->jobs[p]);
+  }
+
+  for (size_t i = 0; i < nthreads; i++)
+    uv_thread_create(&pool->workers[i].thread, shim_worker_run,
+      &pool->workers[i]);
+
+  return pool;
 }
 
 /**
- * \param ctx Currently executing context
- * \param rval The currently pending exception
- * \return TRUE if there was an exception, otherwise FALSE
+ * \param pool The pool to run the job on
+ * \param work_cb Callback that will be called on one of the pool's threads
+ * \param after_cb Callback that will be called on the main thread
+ * \param hint Arbitrary data to be passed to both callbacks
+ * \param priority The priority class of the job
+ * \return The job, valid until \a after_cb returns
  */
-shim_bool_t
-shim_exception_get(shim_ctx_t* ctx, shim_val_t* rval)
+shim_work_t*
+shim_pool_queue_work(shim_pool_t* pool, shim_work_cb work_cb,
+  shim_after_work after_cb, void* hint, shim_priority_t priority)
 {
-  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
-  rval->handle = *trycatch->Exception();
-  return TRUE;
+  shim_work_t* work = shim_work_alloc(
+    shim_isolate_state(Isolate::GetCurrent()), work_cb, after_cb, hint);
+  work->pool = pool;
+
+  if (static_cast<unsigned>(priority) >= SHIM_PRIORITY_COUNT)
+    priority = SHIM_PRIORITY_NORMAL;
+
+  if (pool->inflight++ == 0)
+    uv_ref(reinterpret_cast<uv_handle_t*>(&pool->async));
+
+  shim_worker_t* worker = &pool->workers[pool->next++ % pool->nworkers];
+
+  uv_mutex_lock(&worker->lock);
+  QUEUE_INSERT_TAIL(&worker->jobs[priority], &work->queue);
+  uv_mutex_unlock(&worker->lock);
+
+  __sync_fetch_and_add(&pool->queued, 1);
+
+  uv_mutex_lock(&pool->lock);
+  uv_cond_signal(&pool->cond);
+  uv_mutex_unlock(&pool->lock);
+
+  return work;
 }
 
 /**
- * \param ctx Currently executing context
+ * \param pool The pool to destroy
+ *
+ * Blocks until every queued job has run, their after callbacks are still
+ * delivered before the pool is freed
  */
 void
-shim_exception_clear(shim_ctx_t* ctx)
+shim_pool_destroy(shim_pool_t* pool)
 {
-  TryCatch* trycatch = static_cast<TryCatch*>(ctx->trycatch);
-  trycatch->Reset();
+  uv_mutex_lock(&pool->lock);
+  pool->stopping = TRUE;
+  uv_cond_broadcast(&pool->cond);
+  uv_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->nworkers; i++) {
+    uv_thread_join(&pool->workers[i].thread);
+    uv_mutex_destroy(&pool->workers[i].lock);
+  }
+
+  uv_cond_destroy(&pool->cond);
+  uv_mutex_destroy(&pool->lock);
+
+#if UV_VERSION_MAJOR >= 1
+  shim_pool_complete(&pool->async);
+#else
+  shim_pool_complete(&pool->async, 0);
+#endif
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&pool->async), shim_pool_close_cb);
 }
 
-/**
- * \param ctx Currently executing context
- * \param msg The message to set as the pending exception
- * \param ... Arguments for formatting
- */
+
 void
-shim_throw_error(shim_ctx_t* ctx, const char* msg, ...)
+shim_async_flush(shim_async_t* handle)
 {
-  va_list ap;
-  va_start(ap, msg);
-  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_ERROR, msg, ap));
-  va_end(ap);
+  shim_mpsc_node_t* node = shim_mpsc_take(&handle->pending);
+
+  if (node == NULL)
+    return;
+
+  size_t n = 0;
+  for (shim_mpsc_node_t* cur = node; cur != NULL; cur = cur->next)
+    n++;
+
+  SHIM_PROLOGUE(ctx);
+  shim_val_t* batch = shim::shim_array_new(&ctx, n);
+
+  for (int32_t i = 0; node != NULL; i++) {
+    shim_async_msg_t* msg = node;
+    shim_val_t* val = NULL;
+
+    /* once converted the message is the sender's again, it may be freed */
+    node = node->next;
+    if (handle->convert_cb != NULL)
+      val = handle->convert_cb(&ctx, msg, handle->hint);
+
+    shim::shim_array_set(&ctx, batch, i,
+      val != NULL ? val : shim::shim_undefined());
+  }
+
+  shim_val_t* argv[] = { batch };
+  shim::shim_callback_make(&ctx, handle->func, 1, argv, NULL);
+  shim_context_cleanup(&ctx);
 }
 
-/**
- * \param ctx Currently executing context
- * \param msg The message to set as the pending exception
- * \param ... Arguments for formatting
- */
+
+SHIM_ASYNC_CB(shim_async_deliver, async)
+{
+  shim_async_flush(container_of(async, shim_async_t, async));
+}
+
+
 void
-shim_throw_type_error(shim_ctx_t* ctx, const char* msg, ...)
+shim_async_close_cb(uv_handle_t* handle)
 {
-  va_list ap;
-  va_start(ap, msg);
-  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_TYPE, msg, ap));
-  va_end(ap);
+  shim_async_t* async = container_of(handle, shim_async_t, async);
+  shim::shim_callback_dispose(async->func);
+  delete async;
 }
 
 /**
  * \param ctx Currently executing context
- * \param msg The message to set as the pending exception
- * \param ... Arguments for formatting
+ * \param func The function each batch is delivered to
+ * \param convert_cb Called on the main thread to turn a message into a value
+ * \param hint Arbitrary data passed to convert_cb
+ * \return The new channel
+ *
+ * Messages sent from any thread are queued without locking and delivered on
+ * the main thread as a single array argument to func, one call per wakeup
+ * rather than one per message. Elements are undefined if convert_cb is NULL
+ * or returns NULL. The channel keeps the loop alive until shim_async_close().
  */
-void
-shim_throw_range_error(shim_ctx_t* ctx, const char* msg, ...)
+shim_async_t*
+shim_async_new(shim_ctx_t* ctx, shim_val_t* func,
+  shim_async_convert convert_cb, void* hint)
 {
-  va_list ap;
-  va_start(ap, msg);
-  ThrowException(shim::shim_format_error(ctx, SHIM_ERR_RANGE, msg, ap));
-  va_end(ap);
+  shim_async_t* handle = new shim_async_t;
+  handle->pending = NULL;
+  handle->closing = FALSE;
+  handle->func = shim::shim_callback_new(ctx, func, NULL);
+  handle->convert_cb = convert_cb;
+  handle->hint = hint;
+  uv_async_init(SHIM_STATE(ctx)->loop, &handle->async, shim_async_deliver);
+  return handle;
 }
 
 /**
- * \param ctx Currently executing context
- * \param arg Given wrapped value
- * \param type The destination type
- * \param rval The pointer to where the data will be stored
- * \return TRUE if it was able to convert, otherwise FALSE
+ * \param handle The channel to send to
+ * \param msg The message, usually embedded in the struct it is sent for
+ * \return TRUE if the message was queued, FALSE if the channel is closing
+ *
+ * Safe to call from any thread, but not after shim_async_close() returns.
+ * The message is linked in place, it must stay valid until the channel's
+ * convert_cb has been called with it.
  */
 shim_bool_t
-shim_unpack_type(shim_ctx_t* ctx, shim_val_t* arg, shim_type_t type,
-  void* rval)
+shim_async_send(shim_async_t* handle, shim_async_msg_t* msg)
 {
-  if (!shim::shim_value_is(arg, type))
+  if (handle->closing)
     return FALSE;
 
-  Local<Value> val(SHIM_TO_VAL(arg));
-  shim_val_t* vrval = *(shim_val_t**)rval;
-  switch(type) {
-    case SHIM_TYPE_BOOL:
-      *(shim_bool_t*)rval = val->BooleanValue();
-      break;
-    case SHIM_TYPE_INTEGER:
-      *(int64_t*)rval = val->IntegerValue();
-      break;
-    case SHIM_TYPE_UINT32:
-      *(uint32_t*)rval = val->Uint32Value();
-      break;
-    case SHIM_TYPE_INT32:
-      *(int32_t*)rval = val->Int32Value();
-      break;
-    case SHIM_TYPE_NUMBER:
-      *(double*)rval = val->NumberValue();
-      break;
-    case SHIM_TYPE_EXTERNAL:
-      *(void**)rval = shim::shim_external_value(ctx, arg);
-      break;
-    case SHIM_TYPE_BUFFER:
-      *(char**)rval = shim::shim_buffer_value(arg);
-      break;
-    case SHIM_TYPE_STRING:
-      vrval->handle = *OBJ_TO_STRING(val);
-      break;
-    case SHIM_TYPE_UNDEFINED:
-    case SHIM_TYPE_NULL:
-    case SHIM_TYPE_DATE:
-    case SHIM_TYPE_ARRAY:
-    case SHIM_TYPE_OBJECT:
-    case SHIM_TYPE_FUNCTION:
-    default:
-      return FALSE;
-      break;
-  }
+  if (shim_mpsc_push(&handle->pending, msg))
+    uv_async_send(&handle->async);
 
   return TRUE;
 }
 
 /**
- * \param ctx Currently executing context
- * \param args Arguments passed to the function
- * \param idx Index of the argument to unpack
- * \param type The destination type
- * \param rval The pointer to the destination
- * \return TRUE if it was able to unpack, otherwise FALSE
+ * \param handle The channel to close
+ *
+ * Must be called on the main thread once every sender is done, messages
+ * still queued are delivered before this returns
  */
-shim_bool_t
-shim_unpack_one(shim_ctx_t* ctx, shim_args_t* args, uint32_t idx,
-  shim_type_t type, void* rval)
+void
+shim_async_close(shim_async_t* handle)
 {
-  shim_val_t* arg = args->argv[idx];
-  return shim::shim_unpack_type(ctx, arg, type, rval);
+  handle->closing = TRUE;
+  __sync_synchronize();
+  shim_async_flush(handle);
+  uv_close(reinterpret_cast<uv_handle_t*>(&handle->async),
+    shim_async_close_cb);
 }
 
 /**
- * \param ctx Currently executing context
- * \param args Arguments passed to the function
- * \param type The first type to unpack
- * \return TRUE if all desired arguments were able to be unpacked, otherwise
- * FALSE
- *
- * Arguments are passed in pairs of shim_type_t and a pointer to their
- * destination, you end the set of pairs by a single SHIM_TYPE_UNKNOWN.
+ * \param flags A combination of ::shim_stats_flags_t
  *
- * In the event an argument was unable to be unpacked, FALSE is returned and
- * an exception is set.
+ * Counters keep their values while disabled, use shim_stats_reset() to
+ * start over
  */
-shim_bool_t
-shim_unpack(shim_ctx_t* ctx, shim_args_t* args, shim_type_t type, ...)
+void
+shim_stats_enable(int flags)
 {
-  size_t cur;
-  shim_type_t ctype = type;
-  va_list ap;
-
-  va_start(ap, type);
-
-  for (cur = 0, ctype = type; ctype != SHIM_TYPE_UNKNOWN && cur < args->argc; cur++)
-  {
-    void* rval = va_arg(ap, void*);
-
-    if(!shim::shim_unpack_one(ctx, args, cur, ctype, rval)) {
-      /* TODO this should use a type string */
-      shim::shim_throw_type_error(ctx, "Argument %d not of type %s", cur,
-        shim_type_str(ctype));
-      return FALSE;
-    }
-
-    ctype = static_cast<shim_type_t>(va_arg(ap, int));
-  }
-
-  va_end(ap);
-
-  return TRUE;
+  stats_flags = flags;
 }
 
-/**
- * \param args The arguments passed to the function
- * \return The amount of arguments passed to the function
- */
-size_t
-shim_args_length(shim_args_t* args)
+
+void
+shim_stats_reset_holder(shim_fholder_s* holder)
 {
-  return args->argc;
+  holder->calls = 0;
+  holder->nanos = 0;
+  holder->throws = 0;
 }
 
 /**
- * \param args The arguments passed to the function
- * \param idx The index of the desired argument
- * \return The wrapped argument
+ * Zero the global counters and those of every function
  */
-shim_val_t*
-shim_args_get(shim_args_t* args, size_t idx)
+void
+shim_stats_reset()
 {
-  /* TODO assert */
-  return args->argv[idx];
+  memset(&stats, 0, sizeof(stats));
+
+  uv_once(&states_once, shim_states_init);
+  uv_mutex_lock(&states_lock);
+
+  for (shim_isolate_s* state = states; state != NULL; state = state->next) {
+    for (size_t i = 0; i < state->fcache_size; i++)
+      for (shim_fholder_s* h = state->fcache[i]; h != NULL; h = h->next)
+        shim_stats_reset_holder(h);
+
+    for (struct shim_class_s* k = state->classes; k != NULL; k = k->next)
+      shim_stats_reset_holder(k->holder);
+  }
+
+  uv_mutex_unlock(&states_lock);
 }
 
-/**
- * \param ctx Currently executing context
- * \param args The arguments passed to the function
- * \param val The value to use for return
- * \return TRUE if it was able to set the return value, otherwise FALSE
- */
-shim_bool_t
-shim_args_set_rval(shim_ctx_t* ctx, shim_args_t* args, shim_val_t* val)
+
+void
+shim_stats_holder(Local<Array> functions, shim_fholder_s* holder)
 {
-  /* TODO check if persistent */
-  /*
-  if (!shim_has_allocd(ctx, val))
-    allocs_from_ctx(ctx)->insert(val);
-  */
-  args->ret = val;
-  return TRUE;
+  if (holder->calls == 0 && holder->throws == 0)
+    return;
+
+  Local<Object> entry = Object::New();
+  entry->Set(String::NewSymbol("name"), holder->name != NULL
+    ? String::New(holder->name) : String::Empty());
+  entry->Set(String::NewSymbol("calls"),
+    Number::New(static_cast<double>(holder->calls)));
+  entry->Set(String::NewSymbol("nanos"),
+    Number::New(static_cast<double>(holder->nanos)));
+  entry->Set(String::NewSymbol("exceptions"),
+    Number::New(static_cast<double>(holder->throws)));
+  functions->Set(functions->Length(), entry);
 }
 
 /**
  * \param ctx Currently executing context
- * \param args The arguments passed to the function
- * \return The `this` associated with the executing function
+ * \return An object with the current counters
+ *
+ * The object has `wrappers` and `exceptions` totals, a `functions` array of
+ * `{ name, calls, nanos, exceptions }` for every function called,
+ * `liveFunctions` made by shim_func_new() that have not been collected, the
+ * `initNanos` module initialization took, `lazyPending` and `lazyCreated`
+ * counts of lazily exported functions not yet and already made by a read
+ * (one overwritten before it was read stays pending), a `bufferPool`
+ * object with how many `slabs` and `slabBytes` are held for how many pooled
+ * `buffers` of `bufferBytes`, and a `workLatency` array where entry i counts
+ * jobs whose queue to completion time was in [2^i, 2^(i+1)) nanoseconds
  */
 shim_val_t*
-shim_args_get_this(shim_ctx_t* ctx, shim_args_t* args)
+shim_stats_snapshot(shim_ctx_t* ctx)
 {
-  return args->self;
+  Local<Object> snap = Object::New();
+
+  snap->Set(String::NewSymbol("enabled"), Integer::New(stats_flags));
+  snap->Set(String::NewSymbol("wrappers"),
+    Number::New(static_cast<double>(stats.wrappers)));
+  snap->Set(String::NewSymbol("exceptions"),
+    Number::New(static_cast<double>(stats.exceptions)));
+
+  shim_isolate_s* state = SHIM_STATE(ctx);
+  snap->Set(String::NewSymbol("initNanos"),
+    Number::New(static_cast<double>(state->init_nanos)));
+  snap->Set(String::NewSymbol("lazyPending"),
+    Number::New(static_cast<double>(state->lazy_pending)));
+  snap->Set(String::NewSymbol("lazyCreated"),
+    Number::New(static_cast<double>(state->lazy_created)));
+  Local<Array> functions = Array::New();
+  for (size_t i = 0; i < state->fcache_size; i++)
+    for (shim_fholder_s* h = state->fcache[i]; h != NULL; h = h->next)
+      shim_stats_holder(functions, h);
+  for (struct shim_class_s* k = state->classes; k != NULL; k = k->next)
+    shim_stats_holder(functions, k->holder);
+  snap->Set(String::NewSymbol("functions"), functions);
+  snap->Set(String::NewSymbol("liveFunctions"),
+    Number::New(static_cast<double>(state->fcache_count)));
+
+  Local<Object> pool = Object::New();
+  pool->Set(String::NewSymbol("enabled"),
+    Boolean::New(buffer_pool_enabled != FALSE));
+  pool->Set(String::NewSymbol("slabs"),
+    Number::New(static_cast<double>(buffer_pool_stats.slabs)));
+  pool->Set(String::NewSymbol("slabBytes"),
+    Number::New(static_cast<double>(buffer_pool_stats.slabs
+      * SHIM_BUFFER_SLAB)));
+  pool->Set(String::NewSymbol("buffers"),
+    Number::New(static_cast<double>(buffer_pool_stats.views)));
+  pool->Set(String::NewSymbol("bufferBytes"),
+    Number::New(static_cast<double>(buffer_pool_stats.bytes)));
+  snap->Set(String::NewSymbol("bufferPool"), pool);
+
+  Local<Array> latency = Array::New(SHIM_STATS_BUCKETS);
+  for (uint32_t i = 0; i < SHIM_STATS_BUCKETS; i++)
+    latency->Set(i, Number::New(static_cast<double>(stats.work_latency[i])));
+  snap->Set(String::NewSymbol("workLatency"), latency);
+
+  return shim_val_alloc(ctx, snap, SHIM_TYPE_OBJECT);
 }
 
 /**
  * \param ctx Currently executing context
- * \param args The arguments passed to the function
- * \return Pointer to the arbitrary data associated with the executing function
+ * \param args The arguments, which are ignored
+ * \return TRUE
  */
-void*
-shim_args_get_data(shim_ctx_t* ctx, shim_args_t* args)
-{
-  return args->data;
-}
-
-
-void
-before_work(uv_work_t* req)
-{
-  shim_work_t* work = static_cast<shim_work_t*>(req->data);
-  work->work_cb(work, work->hint);
-}
-
-
-void
-#if NODE_VERSION_AT_LEAST(0, 10, 0)
-before_after(uv_work_t* req, int status)
-{
-#else
-before_after(uv_work_t* req)
+int
+shim_stats_snapshot_js(shim_ctx_t* ctx, shim_args_t* args)
 {
-  int status = 0;
-#endif
-  SHIM_PROLOGUE(ctx);
-  shim_work_t* work = static_cast<shim_work_t*>(req->data);
-  work->after_cb(&ctx, work, status, work->hint);
-  shim_context_cleanup(&ctx);
-  delete work;
-  delete req;
+  return shim::shim_args_set_rval(ctx, args, shim::shim_stats_snapshot(ctx));
 }
 
 /**
- * \param work_cb Callback that will be called on a different thread
- * \param after_cb Callback that will be called on the main thread
- * \param hint Arbitrary data to be passed to both callbacks
+ * \param ctx Currently executing context
+ * \param args Flags to enable, a boolean enables only counting and no
+ * argument enables counting
+ * \return TRUE
  */
-void
-shim_queue_work(shim_work_cb work_cb, shim_after_work after_cb, void* hint)
+int
+shim_stats_enable_js(shim_ctx_t* ctx, shim_args_t* args)
 {
-  uv_work_t* req = new uv_work_t;
-  shim_work_t* work = new shim_work_t;
-  work->work_cb = work_cb;
-  work->after_cb = after_cb;
-  work->hint = hint;
-  req->data = work;
-  uv_queue_work(uv_default_loop(), req, before_work, before_after);
+  int flags = SHIM_STATS_COUNT;
+
+  if (shim::shim_args_length(args) > 0) {
+    Local<Value> arg = SHIM_TO_VAL(shim::shim_args_get(args, 0));
+    if (arg->IsBoolean())
+      flags = arg->BooleanValue() ? SHIM_STATS_COUNT : SHIM_STATS_OFF;
+    else
+      flags = arg->Int32Value();
+  }
+
+  shim::shim_stats_enable(flags);
+  return TRUE;
 }
 
 /**
@@ -1782,6 +6579,8 @@ shim_type_str(shim_type_t type)
     SHIM_ITEM(SHIM_TYPE_FUNCTION)
     SHIM_ITEM(SHIM_TYPE_STRING)
     SHIM_ITEM(SHIM_TYPE_BUFFER)
+    SHIM_ITEM(SHIM_TYPE_TYPEDARRAY)
+    SHIM_ITEM(SHIM_TYPE_ARRAYBUFFER)
 #undef SHIM_ITEM
   }
 }